@@ -0,0 +1,266 @@
+#include "battery.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//  Upper bound on how long a first dirty page waits for the writer to
+//  notice it, in case the wakeup raced with the writer going to sleep.
+#define WRITER_POLL_MS 1000
+
+struct BatterySave {
+    uint8_t *ram;
+    size_t size;
+    char path[PATH_MAX];
+    //  Opened by the writer on the first flush, only ever used by it.
+    int fd;
+    uint32_t interval_ms;
+    //  When the pending pages are due, 0 if not scheduled yet.
+    uint64_t due_ms;
+    atomic_bool pending;
+    atomic_uchar *dirty;
+    struct BatterySave *next;
+};
+
+struct SnapshotPage {
+    size_t index;
+    uint8_t data[SAVE_PAGE_SIZE];
+};
+
+//  Dirty pages copied out of a save under the lock, written to its file by
+//  the writer without it.
+struct Snapshot {
+    BatterySave *save;
+    //  Taken on detach, the writer closes and frees the save after it.
+    bool last;
+    size_t count;
+    struct Snapshot *next;
+    struct SnapshotPage pages[];
+};
+
+//  The lock is only taken by the writer and on attach/detach, never on the
+//  write path. File I/O happens outside of it.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake, drained;
+    BatterySave *saves;
+    //  Snapshots not picked up by the writer yet, oldest first.
+    struct Snapshot *queue, **queue_tail;
+    //  Snapshots the writer picked up and is writing. Only freed with the
+    //  lock held, so attach can still read them.
+    struct Snapshot *writing;
+    bool started;
+} writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+    .queue_tail = &writer.queue,
+};
+
+static uint64_t nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+//  Called with the lock held.
+static void takeSnapshot(BatterySave *save, bool last) {
+    //  Cleared first so a write racing with the copy schedules another one.
+    atomic_store(&save->pending, false);
+    save->due_ms = 0;
+    size_t page_count = save->size / SAVE_PAGE_SIZE;
+    size_t count = 0;
+    for (size_t i = 0; i < page_count; ++i)
+        count += atomic_load(&save->dirty[i]);
+    struct Snapshot *snapshot =
+        malloc(sizeof(*snapshot) + count * sizeof(*snapshot->pages));
+    if (!snapshot)
+        PANIC;
+    snapshot->save = save;
+    snapshot->last = last;
+    snapshot->count = 0;
+    snapshot->next = NULL;
+    //  Pages dirtied since counting stay marked, pending was set again for
+    //  them.
+    for (size_t i = 0; i < page_count && snapshot->count < count; ++i) {
+        if (!atomic_exchange(&save->dirty[i], 0))
+            continue;
+        struct SnapshotPage *page = &snapshot->pages[snapshot->count++];
+        page->index = i;
+        memcpy(page->data, save->ram + i * SAVE_PAGE_SIZE, SAVE_PAGE_SIZE);
+    }
+    *writer.queue_tail = snapshot;
+    writer.queue_tail = &snapshot->next;
+}
+
+//  Called by the writer without the lock.
+static void writeSnapshot(struct Snapshot *snapshot) {
+    BatterySave *save = snapshot->save;
+    if (save->fd < 0 && snapshot->count) {
+        save->fd = open(save->path, O_WRONLY | O_CREAT, 0644);
+        if (save->fd < 0) {
+            fprintf(stderr, "%s could not be opened for writing!\n",
+                    save->path);
+        } else {
+            struct stat st;
+            if (!fstat(save->fd, &st) && (size_t)st.st_size < save->size)
+                ftruncate(save->fd, save->size);
+        }
+    }
+    for (size_t i = 0; save->fd >= 0 && i < snapshot->count; ++i) {
+        const struct SnapshotPage *page = &snapshot->pages[i];
+        if (pwrite(save->fd, page->data, SAVE_PAGE_SIZE,
+                   page->index * SAVE_PAGE_SIZE) != SAVE_PAGE_SIZE)
+            fprintf(stderr, "%s could not be written!\n", save->path);
+    }
+    if (snapshot->last && save->fd >= 0)
+        close(save->fd);
+}
+
+//  Called by the writer with the lock held.
+static void freeSnapshot(struct Snapshot *snapshot) {
+    if (snapshot->last) {
+        free(snapshot->save->dirty);
+        free(snapshot->save);
+    }
+    free(snapshot);
+}
+
+static void *runWriter(void *input) {
+    pthread_mutex_lock(&writer.lock);
+    while (true) {
+        uint64_t now = nowMs();
+        uint64_t wake = now + WRITER_POLL_MS;
+        for (BatterySave *save = writer.saves; save; save = save->next) {
+            if (!atomic_load(&save->pending))
+                continue;
+            if (!save->due_ms)
+                save->due_ms = now + save->interval_ms;
+            if (now >= save->due_ms)
+                takeSnapshot(save, false);
+            else if (save->due_ms < wake)
+                wake = save->due_ms;
+        }
+        if (writer.queue) {
+            writer.writing = writer.queue;
+            writer.queue = NULL;
+            writer.queue_tail = &writer.queue;
+            pthread_mutex_unlock(&writer.lock);
+            for (struct Snapshot *snapshot = writer.writing; snapshot;
+                 snapshot = snapshot->next)
+                writeSnapshot(snapshot);
+            pthread_mutex_lock(&writer.lock);
+            while (writer.writing) {
+                struct Snapshot *next = writer.writing->next;
+                freeSnapshot(writer.writing);
+                writer.writing = next;
+            }
+            continue;
+        }
+        pthread_cond_broadcast(&writer.drained);
+        struct timespec ts = {.tv_sec = wake / 1000,
+                              .tv_nsec = wake % 1000 * 1000000};
+        pthread_cond_timedwait(&writer.wake, &writer.lock, &ts);
+    }
+    return NULL;
+}
+
+//  Run at exit, returns once every snapshot taken so far is written so the
+//  pages of saves detached right before are not lost.
+static void drainWriter(void) {
+    pthread_mutex_lock(&writer.lock);
+    while (writer.queue || writer.writing)
+        pthread_cond_wait(&writer.drained, &writer.lock);
+    pthread_mutex_unlock(&writer.lock);
+}
+
+//  Copies the pages queued or being written for path, oldest first.
+static struct SnapshotPage *collectPages(const char *path, size_t size,
+                                         size_t *count) {
+    struct SnapshotPage *pages = NULL;
+    *count = 0;
+    pthread_mutex_lock(&writer.lock);
+    struct Snapshot *lists[] = {writer.writing, writer.queue};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(*lists); ++i) {
+        for (struct Snapshot *snapshot = lists[i]; snapshot;
+             snapshot = snapshot->next) {
+            if (!snapshot->count || strcmp(snapshot->save->path, path) ||
+                snapshot->save->size != size)
+                continue;
+            pages = realloc(pages,
+                            (*count + snapshot->count) * sizeof(*pages));
+            if (!pages)
+                PANIC;
+            memcpy(pages + *count, snapshot->pages,
+                   snapshot->count * sizeof(*pages));
+            *count += snapshot->count;
+        }
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return pages;
+}
+
+BatterySave *attachBatterySave(uint8_t *ram, size_t size, const char *path,
+                               uint32_t interval_ms) {
+    BatterySave *save = calloc(1, sizeof(*save));
+    if (!save)
+        PANIC;
+    save->dirty = calloc(size / SAVE_PAGE_SIZE, sizeof(*save->dirty));
+    if (!save->dirty)
+        PANIC;
+    save->ram = ram;
+    save->size = size;
+    save->fd = -1;
+    save->interval_ms = interval_ms;
+    snprintf(save->path, sizeof(save->path), "%s", path);
+    //  A save of the same file detached just before may not be written yet.
+    //  Its pages are newer than the file and go on top, they are collected
+    //  first since the writer frees them once written.
+    size_t newer_count;
+    struct SnapshotPage *newer = collectPages(path, size, &newer_count);
+    //  Read on the loading thread, before the core runs.
+    FILE *file = fopen(path, "r");
+    if (file) {
+        fread(ram, 1, size, file);
+        fclose(file);
+    }
+    for (size_t i = 0; i < newer_count; ++i)
+        memcpy(ram + newer[i].index * SAVE_PAGE_SIZE, newer[i].data,
+               SAVE_PAGE_SIZE);
+    free(newer);
+    pthread_mutex_lock(&writer.lock);
+    if (!writer.started) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, runWriter, NULL);
+        pthread_detach(thread);
+        atexit(drainWriter);
+        writer.started = true;
+    }
+    save->next = writer.saves;
+    writer.saves = save;
+    pthread_mutex_unlock(&writer.lock);
+    return save;
+}
+
+void detachBatterySave(BatterySave *save) {
+    pthread_mutex_lock(&writer.lock);
+    BatterySave **link = &writer.saves;
+    while (*link != save)
+        link = &(*link)->next;
+    *link = save->next;
+    //  Always queued, the writer owns the save from here on.
+    takeSnapshot(save, true);
+    pthread_cond_signal(&writer.wake);
+    pthread_mutex_unlock(&writer.lock);
+}
+
+void markBatteryDirty(BatterySave *save, size_t offset) {
+    atomic_store(&save->dirty[offset / SAVE_PAGE_SIZE], 1);
+    if (!atomic_exchange(&save->pending, true))
+        pthread_cond_signal(&writer.wake);
+}
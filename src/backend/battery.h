@@ -0,0 +1,25 @@
+/*
+    Persistence of battery-backed cartridge RAM. Writes only mark their
+    256 byte page dirty, a writer thread shared by all instances copies the
+    dirty pages out and writes them to the .sav file at the configured
+    interval, without holding the lock attach and detach take. The file is
+    not even created before the first write.
+*/
+#pragma once
+#include <utility.h>
+
+#define SAVE_PAGE_SIZE 256
+
+typedef struct BatterySave BatterySave;
+
+//  Starts tracking ram, which is first filled from path if it exists and
+//  from pages of an earlier save of path still queued. Reads the file on
+//  the calling thread, so it is called while loading, before the core runs.
+BatterySave *attachBatterySave(uint8_t *ram, size_t size, const char *path,
+                               uint32_t interval_ms);
+//  Stops tracking and hands the pages still dirty to the writer, ram may
+//  be freed right after. They are written before the process exits.
+void detachBatterySave(BatterySave *save);
+
+//  Never blocks, safe to call from the emulation thread on every write.
+void markBatteryDirty(BatterySave *save, size_t offset);
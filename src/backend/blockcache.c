@@ -0,0 +1,85 @@
+#include "blockcache.h"
+#include <string.h>
+
+void initBlockCache(BlockCache *cache) {
+    if (!cache->blocks)
+        cache->blocks = calloc(UINT16_MAX + 1, sizeof(*cache->blocks));
+    if (!cache->blocks)
+        PANIC;
+    cache->generation = 0;
+}
+
+void destroyBlockCache(BlockCache *cache) {
+    if (!cache->blocks)
+        return;
+    for (size_t pc = 0; pc <= UINT16_MAX; ++pc)
+        free(cache->blocks[pc]);
+    free(cache->blocks);
+    cache->blocks = NULL;
+}
+
+struct CachedBlock *lookupBlock(BlockCache *cache, uint16_t pc) {
+    return cache->blocks[pc];
+}
+
+struct CachedBlock *insertBlock(BlockCache *cache, uint8_t *code_pages,
+                                uint16_t pc, const struct MicroOp *ops,
+                                uint8_t op_count) {
+    struct CachedBlock *block =
+        malloc(sizeof(*block) + sizeof(*ops) * op_count);
+    if (!block)
+        PANIC;
+    block->native = NULL;
+    block->pc = pc;
+    block->cycles = 0;
+    block->op_count = op_count;
+    memcpy(block->ops, ops, sizeof(*ops) * op_count);
+    for (uint8_t i = 0; i < op_count; ++i)
+        block->cycles += ops[i].cycles * 4;
+    free(cache->blocks[pc]);
+    cache->blocks[pc] = block;
+    const struct MicroOp *last = &ops[op_count - 1];
+    uint16_t end = last->pc + last->length - 1;
+    for (uint32_t page = pc >> 8; page <= (uint32_t)(end >> 8); ++page)
+        code_pages[page] = true;
+    return block;
+}
+
+static void dropPageBlocks(BlockCache *cache, uint8_t *code_pages,
+                           uint8_t page) {
+    //  Blocks starting up to BLOCK_MAX_BYTES before the page can reach into it.
+    int32_t begin = page * 256 - BLOCK_MAX_BYTES;
+    int32_t end = page * 256 + 256;
+    for (int32_t pc = begin < 0 ? 0 : begin; pc < end; ++pc) {
+        struct CachedBlock *block = cache->blocks[pc];
+        if (!block)
+            continue;
+        const struct MicroOp *last = &block->ops[block->op_count - 1];
+        if (pc < page * 256 && last->pc + last->length <= page * 256)
+            continue;
+        free(block);
+        cache->blocks[pc] = NULL;
+    }
+    code_pages[page] = false;
+    ++cache->generation;
+}
+
+void invalidateBlockPage(BlockCache *cache, uint8_t *code_pages,
+                         uint8_t page) {
+    dropPageBlocks(cache, code_pages, page);
+    if (cache->invalidations[page] < UINT8_MAX)
+        ++cache->invalidations[page];
+}
+
+void remapBlockPage(BlockCache *cache, uint8_t *code_pages, uint8_t page) {
+    dropPageBlocks(cache, code_pages, page);
+}
+
+void flushBlockCache(BlockCache *cache, uint8_t *code_pages) {
+    for (size_t pc = 0; pc <= UINT16_MAX; ++pc) {
+        free(cache->blocks[pc]);
+        cache->blocks[pc] = NULL;
+    }
+    memset(code_pages, 0, BLOCK_PAGE_COUNT);
+    ++cache->generation;
+}
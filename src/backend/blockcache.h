@@ -0,0 +1,67 @@
+/*
+    Cache of pre-decoded straight-line blocks for the cached interpreter.
+    Blocks are keyed by the PC of their first instruction and are dropped
+    whenever a write lands on a page that holds cached code or the page is
+    switched to another bank.
+*/
+#pragma once
+#include <utility.h>
+
+#define BLOCK_MAX_OPS 32
+#define BLOCK_MAX_BYTES (BLOCK_MAX_OPS * 3)
+#define BLOCK_PAGE_COUNT 256
+
+typedef struct CPU CPU;
+typedef void (*OpcodeHandler)(CPU *);
+typedef void (*NativeBlock)(CPU *);
+
+struct MicroOp {
+    OpcodeHandler func;
+    uint16_t pc;
+    //  Opcode bytes (1, or 2 for CB-prefixed) consumed before func runs.
+    uint8_t prefix;
+    uint8_t length;
+    //  First opcode byte and the operand after it, for the dynarec.
+    uint8_t opcode;
+    //  Worst-case M-cycles, including the opcode fetch.
+    uint8_t cycles;
+    uint16_t operand;
+};
+
+struct CachedBlock {
+    //  Recompiled code for the block, if the dynarec has translated it.
+    NativeBlock native;
+    uint16_t pc;
+    //  Worst-case T-cycles of all ops.
+    uint16_t cycles;
+    uint8_t op_count;
+    struct MicroOp ops[];
+};
+
+typedef struct {
+    struct CachedBlock **blocks;
+    //  Bumped on every invalidation so a running block can tell it was freed.
+    uint32_t generation;
+    //  Saturating count of invalidations per page.
+    uint8_t invalidations[BLOCK_PAGE_COUNT];
+} BlockCache;
+
+void initBlockCache(BlockCache *cache);
+void destroyBlockCache(BlockCache *cache);
+
+struct CachedBlock *lookupBlock(BlockCache *cache, uint16_t pc);
+struct CachedBlock *insertBlock(BlockCache *cache, uint8_t *code_pages,
+                                uint16_t pc, const struct MicroOp *ops,
+                                uint8_t op_count);
+void invalidateBlockPage(BlockCache *cache, uint8_t *code_pages, uint8_t page);
+//  Like invalidateBlockPage for a page that was mapped to other memory, which
+//  does not count towards the self-modifying code threshold.
+void remapBlockPage(BlockCache *cache, uint8_t *code_pages, uint8_t page);
+void flushBlockCache(BlockCache *cache, uint8_t *code_pages);
+
+/*
+    Decodes the block starting at pc into ops, returns the number of
+    micro-ops or 0 if pc is not cacheable. Implemented next to the opcode
+    tables in cpu.c.
+*/
+uint8_t decodeBlock(CPU *cpu, uint16_t pc, struct MicroOp *ops);
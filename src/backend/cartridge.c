@@ -0,0 +1,326 @@
+#include "cartridge.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEADER_TYPE 0x147
+#define HEADER_ROM_SIZE 0x148
+#define HEADER_RAM_SIZE 0x149
+
+static const size_t RAM_SIZES[] = {0, KB(2), KB(8), KB(32), KB(128), KB(64)};
+
+struct ROMImage {
+    uint8_t *data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    off_t file_size;
+    //  A file rewritten in place keeps its inode, padded copies would go
+    //  stale without this.
+    struct timespec mtime;
+    size_t refs;
+    struct ROMImage *next;
+};
+
+static struct ROMImage *rom_images;
+static pthread_mutex_t rom_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct {
+    uint8_t type;
+    enum MBCType mbc;
+    bool ram, battery;
+} CART_TYPES[] = {
+    {0x00, MBC_NONE, false, false}, {0x08, MBC_NONE, true, false},
+    {0x09, MBC_NONE, true, true},   {0x01, MBC_1, false, false},
+    {0x02, MBC_1, true, false},     {0x03, MBC_1, true, true},
+    {0x0F, MBC_3, false, true},     {0x10, MBC_3, true, true},
+    {0x11, MBC_3, false, false},    {0x12, MBC_3, true, false},
+    {0x13, MBC_3, true, true},      {0x19, MBC_5, false, false},
+    {0x1A, MBC_5, true, false},     {0x1B, MBC_5, true, true},
+    //  Rumble carts, the motor is left unemulated.
+    {0x1C, MBC_5, false, false},    {0x1D, MBC_5, true, false},
+    {0x1E, MBC_5, true, true},
+};
+
+static bool parseType(Cartridge *cart, uint8_t type, bool *has_ram) {
+    for (size_t i = 0; i < sizeof(CART_TYPES) / sizeof(*CART_TYPES); ++i) {
+        if (CART_TYPES[i].type != type)
+            continue;
+        cart->mbc = CART_TYPES[i].mbc;
+        cart->battery = CART_TYPES[i].battery;
+        *has_ram = CART_TYPES[i].ram;
+        return true;
+    }
+    return false;
+}
+
+//  Banks are masked by the ROM size, so it is rounded up to a power of two
+//  no smaller than both the file and what the header claims.
+static size_t romSize(const uint8_t *header, size_t file_size) {
+    size_t size = ROM_BANK_SIZE * 2;
+    if (header[HEADER_ROM_SIZE] <= 8)
+        size <<= header[HEADER_ROM_SIZE];
+    while (size < file_size)
+        size <<= 1;
+    return size;
+}
+
+//  Maps the file directly when it fills the whole ROM, short dumps get a
+//  zero padded anonymous copy instead.
+static uint8_t *mapImage(int fd, size_t size, size_t file_size) {
+    if (size == file_size) {
+        void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        return data == MAP_FAILED ? NULL : data;
+    }
+    uint8_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+    if (pread(fd, data, file_size, 0) != (ssize_t)file_size) {
+        munmap(data, size);
+        return NULL;
+    }
+    mprotect(data, size, PROT_READ);
+    return data;
+}
+
+//  Returns the shared image of the file at fd, mapping it on first use.
+//  Called with rom_images_lock held.
+static struct ROMImage *acquireImage(int fd, const struct stat *st,
+                                     const uint8_t *header) {
+    for (struct ROMImage *image = rom_images; image; image = image->next) {
+        if (image->dev == st->st_dev && image->ino == st->st_ino &&
+            image->file_size == st->st_size &&
+            image->mtime.tv_sec == st->st_mtim.tv_sec &&
+            image->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            ++image->refs;
+            return image;
+        }
+    }
+    size_t size = romSize(header, st->st_size);
+    uint8_t *data = mapImage(fd, size, st->st_size);
+    if (!data)
+        return NULL;
+    struct ROMImage *image = malloc(sizeof(*image));
+    if (!image)
+        PANIC;
+    *image = (struct ROMImage){
+        .data = data,
+        .size = size,
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .file_size = st->st_size,
+        .mtime = st->st_mtim,
+        .refs = 1,
+        .next = rom_images,
+    };
+    rom_images = image;
+    return image;
+}
+
+static void releaseImage(struct ROMImage *image) {
+    pthread_mutex_lock(&rom_images_lock);
+    if (--image->refs == 0) {
+        struct ROMImage **link = &rom_images;
+        while (*link != image)
+            link = &(*link)->next;
+        *link = image->next;
+        munmap(image->data, image->size);
+        free(image);
+    }
+    pthread_mutex_unlock(&rom_images_lock);
+}
+
+bool loadCartridge(Cartridge *cart, const char *path) {
+    destroyCartridge(cart);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "%s rom could not be found!\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if (st.st_size > ROM_MAX_SIZE) {
+        fprintf(stderr, "rom file too large!\n");
+        close(fd);
+        return false;
+    }
+    uint8_t header[HEADER_RAM_SIZE + 1] = {0};
+    pread(fd, header, sizeof(header), 0);
+    bool has_ram;
+    if (!parseType(cart, header[HEADER_TYPE], &has_ram)) {
+        fprintf(stderr, "unsupported cartridge type 0x%02x!\n",
+                header[HEADER_TYPE]);
+        close(fd);
+        return false;
+    }
+    pthread_mutex_lock(&rom_images_lock);
+    cart->image = acquireImage(fd, &st, header);
+    pthread_mutex_unlock(&rom_images_lock);
+    close(fd);
+    if (!cart->image) {
+        fprintf(stderr, "%s rom could not be mapped!\n", path);
+        memset(cart, 0, sizeof(*cart));
+        return false;
+    }
+    cart->rom = cart->image->data;
+    cart->rom_size = cart->image->size;
+    uint8_t ram_code = header[HEADER_RAM_SIZE];
+    if (has_ram && ram_code < sizeof(RAM_SIZES) / sizeof(*RAM_SIZES) &&
+        RAM_SIZES[ram_code]) {
+        //  2KB chips are mirrored over the whole bank.
+        cart->ram_size = RAM_SIZES[ram_code] < RAM_BANK_SIZE
+                             ? RAM_BANK_SIZE
+                             : RAM_SIZES[ram_code];
+        cart->ram = calloc(cart->ram_size, 1);
+        if (!cart->ram)
+            PANIC;
+    }
+    //  Without an MBC there is nothing to enable the RAM with.
+    cart->ram_enabled = cart->mbc == MBC_NONE;
+    cart->rom_bank = 1;
+    return true;
+}
+
+void destroyCartridge(Cartridge *cart) {
+    if (cart->save)
+        detachBatterySave(cart->save);
+    if (cart->image)
+        releaseImage(cart->image);
+    free(cart->ram);
+    memset(cart, 0, sizeof(*cart));
+}
+
+bool attachCartridgeSave(Cartridge *cart, const char *path,
+                         uint32_t interval_ms) {
+    if (!cart->battery || !cart->ram || cart->save)
+        return false;
+    cart->save =
+        attachBatterySave(cart->ram, cart->ram_size, path, interval_ms);
+    return true;
+}
+
+static void writeMBC1(Cartridge *cart, uint16_t adr, uint8_t val) {
+    switch (adr >> 13) {
+    case 0:
+        cart->ram_enabled = (val & 0x0F) == 0x0A;
+        break;
+    case 1:
+        cart->rom_bank = val & 0x1F ? val & 0x1F : 1;
+        break;
+    case 2:
+        cart->ram_bank = val & 0x03;
+        break;
+    case 3:
+        cart->mbc1_mode = val & 0x01;
+        break;
+    }
+}
+
+static void writeMBC3(Cartridge *cart, uint16_t adr, uint8_t val) {
+    switch (adr >> 13) {
+    case 0:
+        cart->ram_enabled = (val & 0x0F) == 0x0A;
+        break;
+    case 1:
+        cart->rom_bank = val & 0x7F ? val & 0x7F : 1;
+        break;
+    case 2:
+        cart->ram_bank = val & 0x0F;
+        break;
+    case 3:
+        //  Latching the clock is a no-op as it never ticks.
+        break;
+    }
+}
+
+static void writeMBC5(Cartridge *cart, uint16_t adr, uint8_t val) {
+    switch (adr >> 12) {
+    case 0x0:
+    case 0x1:
+        cart->ram_enabled = (val & 0x0F) == 0x0A;
+        break;
+    case 0x2:
+        cart->rom_bank = (cart->rom_bank & 0x100) | val;
+        break;
+    case 0x3:
+        cart->rom_bank = (cart->rom_bank & 0xFF) | (val & 0x01) << 8;
+        break;
+    case 0x4:
+    case 0x5:
+        cart->ram_bank = val & 0x0F;
+        break;
+    }
+}
+
+bool cartWriteMBC(Cartridge *cart, uint16_t adr, uint8_t val) {
+    size_t bank0 = cartROMOffset(cart, 0x0000);
+    size_t bank1 = cartROMOffset(cart, ROM_BANK_SIZE);
+    uint8_t *ram = cartRAMBank(cart);
+    switch (cart->mbc) {
+    case MBC_NONE:
+        return false;
+    case MBC_1:
+        writeMBC1(cart, adr, val);
+        break;
+    case MBC_3:
+        writeMBC3(cart, adr, val);
+        break;
+    case MBC_5:
+        writeMBC5(cart, adr, val);
+        break;
+    }
+    return bank0 != cartROMOffset(cart, 0x0000) ||
+           bank1 != cartROMOffset(cart, ROM_BANK_SIZE) ||
+           ram != cartRAMBank(cart);
+}
+
+size_t cartROMOffset(const Cartridge *cart, uint16_t adr) {
+    size_t bank = 0;
+    if (adr >= ROM_BANK_SIZE)
+        bank = cart->mbc == MBC_1 ? cart->ram_bank << 5 | cart->rom_bank
+                                  : cart->rom_bank;
+    else if (cart->mbc == MBC_1 && cart->mbc1_mode)
+        bank = cart->ram_bank << 5;
+    return ((bank * ROM_BANK_SIZE) & (cart->rom_size - 1)) |
+           (adr & (ROM_BANK_SIZE - 1));
+}
+
+uint8_t *cartRAMBank(const Cartridge *cart) {
+    if (!cart->ram_enabled || !cart->ram)
+        return NULL;
+    size_t bank = cart->ram_bank;
+    if (cart->mbc == MBC_NONE || (cart->mbc == MBC_1 && !cart->mbc1_mode))
+        bank = 0;
+    else if (cart->mbc == MBC_3 && bank >= 0x08)
+        return NULL;
+    return cart->ram + ((bank * RAM_BANK_SIZE) & (cart->ram_size - 1));
+}
+
+uint8_t cartReadRAM(const Cartridge *cart, uint16_t adr) {
+    if (!cart->ram_enabled)
+        return 0xFF;
+    if (cart->mbc == MBC_3 && cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C)
+        return cart->rtc[cart->ram_bank - 0x08];
+    uint8_t *bank = cartRAMBank(cart);
+    return bank ? bank[adr & (RAM_BANK_SIZE - 1)] : 0xFF;
+}
+
+void cartWriteRAM(Cartridge *cart, uint16_t adr, uint8_t val) {
+    if (!cart->ram_enabled)
+        return;
+    if (cart->mbc == MBC_3 && cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C)
+        cart->rtc[cart->ram_bank - 0x08] = val;
+    uint8_t *bank = cartRAMBank(cart);
+    if (!bank)
+        return;
+    bank[adr & (RAM_BANK_SIZE - 1)] = val;
+    if (cart->save)
+        markBatteryDirty(cart->save,
+                         bank - cart->ram + (adr & (RAM_BANK_SIZE - 1)));
+}
@@ -0,0 +1,67 @@
+/*
+    Cartridge ROM, external RAM and the memory bank controller state. Bank
+    switches only update the selected banks, the memory map then points its
+    pages at the new banks without copying anything.
+    ROM images are mapped read-only and shared by every instance that loads
+    the same file, so memory grows with distinct ROMs rather than sessions.
+*/
+#pragma once
+#include <utility.h>
+#include "battery.h"
+
+#define ROM_BANK_SIZE KB(16)
+#define RAM_BANK_SIZE KB(8)
+#define ROM_MAX_SIZE MB(8)
+#define CART_RAM_MAX_SIZE KB(128)
+
+enum MBCType {
+    MBC_NONE = 0,
+    MBC_1,
+    MBC_3,
+    MBC_5,
+};
+
+struct ROMImage;
+
+typedef struct {
+    //  Read-only, points into the shared image.
+    uint8_t *rom;
+    struct ROMImage *image;
+    uint8_t *ram;
+    //  Only set for battery-backed carts with persistence enabled.
+    BatterySave *save;
+    //  Power of two multiples of the bank sizes, so banks wrap with a mask.
+    size_t rom_size;
+    size_t ram_size;
+    enum MBCType mbc;
+    bool battery;
+    bool ram_enabled;
+    //  MBC1 splits the bank number in a 5 bit and a 2 bit register, the
+    //  latter selects the RAM bank or the upper ROM bank bits per mode.
+    uint16_t rom_bank;
+    uint8_t ram_bank;
+    uint8_t mbc1_mode;
+    //  MBC3 clock registers, selected as RAM banks 0x08-0x0C. They hold
+    //  whatever was written but do not tick.
+    uint8_t rtc[5];
+} Cartridge;
+
+//  Returns false and leaves cart empty if path is not a supported ROM.
+bool loadCartridge(Cartridge *cart, const char *path);
+void destroyCartridge(Cartridge *cart);
+//  Loads and keeps updating the .sav file at path, false if the cart has
+//  no battery-backed RAM.
+bool attachCartridgeSave(Cartridge *cart, const char *path,
+                         uint32_t interval_ms);
+
+//  Handles a write to the MBC registers in 0x0000-0x7FFF, returns true if
+//  the mapped banks changed.
+bool cartWriteMBC(Cartridge *cart, uint16_t adr, uint8_t val);
+
+//  Offset into rom of the byte currently mapped at adr (0x0000-0x7FFF).
+size_t cartROMOffset(const Cartridge *cart, uint16_t adr);
+//  The mapped 8KB RAM bank, NULL if RAM is disabled, absent or a clock
+//  register is selected.
+uint8_t *cartRAMBank(const Cartridge *cart);
+uint8_t cartReadRAM(const Cartridge *cart, uint16_t adr);
+void cartWriteRAM(Cartridge *cart, uint16_t adr, uint8_t val);
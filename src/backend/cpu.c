@@ -2,19 +2,89 @@
 #include <string.h>
 #include <stdio.h>
 #include <backend/events.h>
+#include <backend/renderer.h>
 
 #define SET_Z(state) (cpu->f.z = (state) != 0)
 #define SET_N(state) (cpu->f.n = (state) != 0)
 #define SET_H(state) (cpu->f.h = (state) != 0)
 #define SET_C(state) (cpu->f.c = (state) != 0)
 
-void tickM(CPU *cpu, size_t cycles) {
-    size_t t_cycles = cycles * 4;
-    cpu->t_cycles += t_cycles;
-    while (t_cycles--)
-        ppuTick(&cpu->ppu, &cpu->memory);
+//  LAZY FLAGS
+
+/*
+    ADD/ADC/SUB/SBC/CP/INC/DEC only record their operands and result, the
+    flags are worked out when something reads them. Instructions that
+    replace all four flags use setFlags, the ones that keep some of them
+    materialize the pending flags first.
+*/
+
+__always_inline bool lazyH(const CPU *cpu) {
+    const struct LazyFlags *lazy = &cpu->lazy;
+    switch (lazy->op) {
+    case LAZY_ADD:
+        return (lazy->lhs & 0x0F) + (lazy->rhs & 0x0F) + lazy->carry > 0x0F;
+    case LAZY_SUB:
+        return (lazy->lhs & 0x0F) < (lazy->rhs & 0x0F) + lazy->carry;
+    case LAZY_INC:
+        return (lazy->lhs & 0x0F) == 0x0F;
+    case LAZY_DEC:
+        return (lazy->lhs & 0x0F) == 0;
+    }
+    return cpu->f.h;
+}
+
+__always_inline bool flagC(const CPU *cpu) {
+    const struct LazyFlags *lazy = &cpu->lazy;
+    switch (lazy->op) {
+    case LAZY_ADD:
+        return lazy->lhs + lazy->rhs + lazy->carry > 0xFF;
+    case LAZY_SUB:
+        return lazy->lhs < lazy->rhs + lazy->carry;
+    }
+    return cpu->f.c;
+}
+
+__always_inline bool flagZ(const CPU *cpu) {
+    return cpu->lazy.op != LAZY_NONE ? cpu->lazy.res == 0 : cpu->f.z;
+}
+
+__always_inline void setFlags(CPU *cpu, bool z, bool n, bool h, bool c) {
+    cpu->flags = z << 7 | n << 6 | h << 5 | c << 4;
+    cpu->lazy.op = LAZY_NONE;
+}
+
+__always_inline void materializeFlags(CPU *cpu) {
+    const struct LazyFlags *lazy = &cpu->lazy;
+    if (lazy->op == LAZY_NONE)
+        return;
+    setFlags(cpu, lazy->res == 0, lazy->op == LAZY_SUB || lazy->op == LAZY_DEC,
+             lazyH(cpu), flagC(cpu));
 }
 
+void syncFlags(CPU *cpu) { materializeFlags(cpu); }
+
+//  INC/DEC keep C, so a carry pending from ADD/SUB must land in f first.
+__always_inline void recordLazyIncDec(CPU *cpu, enum LazyFlagOp op,
+                                      uint8_t lhs, uint8_t res) {
+    if (cpu->lazy.op == LAZY_ADD || cpu->lazy.op == LAZY_SUB)
+        cpu->f.c = flagC(cpu);
+    cpu->lazy.op = op;
+    cpu->lazy.lhs = lhs;
+    cpu->lazy.res = res;
+}
+
+__always_inline void recordLazyALU(CPU *cpu, enum LazyFlagOp op, uint8_t lhs,
+                                   uint8_t rhs, bool carry, uint8_t res) {
+    cpu->lazy.op = op;
+    cpu->lazy.lhs = lhs;
+    cpu->lazy.rhs = rhs;
+    cpu->lazy.carry = carry;
+    cpu->lazy.res = res;
+}
+
+//  The PPU is only brought up to date when it is observed, see ppuSync.
+void tickM(CPU *cpu, size_t cycles) { cpu->t_cycles += cycles * 4; }
+
 typedef enum {
     _V00h = 0x00,
     _V08h = 0x08,
@@ -46,50 +116,6 @@ static void cpuWrite(CPU *cpu, uint16_t adr, uint8_t val) {
     memWrite(&cpu->memory, adr, val);
 }
 
-uint8_t determineRegister(CPU *cpu, uint8_t opc) {
-    switch (opc % 8) {
-    case 0:
-        return cpu->b;
-    case 1:
-        return cpu->c;
-    case 2:
-        return cpu->d;
-    case 3:
-        return cpu->e;
-    case 4:
-        return cpu->h;
-    case 5:
-        return cpu->l;
-    case 6:
-        return cpuRead(cpu, cpu->hl);
-    case 7:
-        return cpu->a;
-    }
-    PANIC;
-    return 0;
-}
-
-uint8_t *determineRegisterCB(CPU *cpu, uint8_t opc) {
-    switch (opc % 8) {
-    case 0:
-        return &cpu->b;
-    case 1:
-        return &cpu->c;
-    case 2:
-        return &cpu->d;
-    case 3:
-        return &cpu->e;
-    case 4:
-        return &cpu->h;
-    case 5:
-        return &cpu->l;
-    case 7:
-        return &cpu->a;
-    }
-    PANIC;
-    return NULL;
-}
-
 //  LOAD INSTRUCTIONS
 
 static void LD_r8_r8(CPU *cpu, uint8_t *dest, uint8_t src) { *dest = src; }
@@ -126,8 +152,6 @@ static void LD_A_pHLi(CPU *cpu) { cpu->a = cpuRead(cpu, cpu->hl++); }
 
 static void LD_A_pHLd(CPU *cpu) { cpu->a = cpuRead(cpu, cpu->hl--); }
 
-static void LD_SP_u16(CPU *cpu) { cpu->sp = fetch16(cpu); }
-
 static void LD_pu16_SP(CPU *cpu) {
     uint16_t adr = fetch16(cpu);
     cpuWrite(cpu, adr, cpu->sp);
@@ -136,10 +160,8 @@ static void LD_pu16_SP(CPU *cpu) {
 
 static void LD_HL_SPi8(CPU *cpu) {
     uint8_t imm = fetch(cpu);
-    SET_Z(false);
-    SET_N(false);
-    SET_H((cpu->sp & 0x0F) + (imm & 0x0F) > 0x0F);
-    SET_C((cpu->sp & 0xFF) + imm > 0xFF);
+    setFlags(cpu, false, false, (cpu->sp & 0x0F) + (imm & 0x0F) > 0x0F,
+             (cpu->sp & 0xFF) + imm > 0xFF);
     cpu->hl = cpu->sp + (int8_t)imm;
     tickM(cpu, 1);
 }
@@ -153,16 +175,14 @@ static void LD_SP_HL(CPU *cpu) {
 
 /* ADC */
 __always_inline void __ADC(CPU *cpu, uint8_t src, bool carry) {
-    SET_N(false);
-    SET_H((cpu->a & 0x0F) + (src & 0x0F) + carry > 0x0F);
-    SET_C(cpu->a + src + carry > 0xFF);
+    uint8_t lhs = cpu->a;
     cpu->a += src + carry;
-    SET_Z(cpu->a == 0);
+    recordLazyALU(cpu, LAZY_ADD, lhs, src, carry, cpu->a);
 }
 
-static void ADC_r8(CPU *cpu, uint8_t src) { __ADC(cpu, src, cpu->f.c); }
+static void ADC_r8(CPU *cpu, uint8_t src) { __ADC(cpu, src, flagC(cpu)); }
 
-static void ADC_u8(CPU *cpu) { __ADC(cpu, fetch(cpu), cpu->f.c); }
+static void ADC_u8(CPU *cpu) { __ADC(cpu, fetch(cpu), flagC(cpu)); }
 
 /* ADD */
 
@@ -173,10 +193,7 @@ static void ADD_u8(CPU *cpu) { __ADC(cpu, fetch(cpu), 0); }
 /* CP */
 
 __always_inline void __CP(CPU *cpu, uint8_t src) {
-    SET_Z(cpu->a == src);
-    SET_N(true);
-    SET_H((cpu->a & 0x0F) < (src & 0x0F));
-    SET_C(cpu->a < src);
+    recordLazyALU(cpu, LAZY_SUB, cpu->a, src, false, cpu->a - src);
 }
 
 static void CP_r8(CPU *cpu, uint8_t src) { __CP(cpu, src); }
@@ -186,6 +203,7 @@ static void CP_u8(CPU *cpu) { __CP(cpu, fetch(cpu)); }
 /* CPL */
 
 static void CPL(CPU *cpu) {
+    materializeFlags(cpu);
     cpu->a = ~cpu->a;
     SET_N(true);
     SET_H(true);
@@ -194,10 +212,8 @@ static void CPL(CPU *cpu) {
 /* DEC */
 
 __always_inline void __DEC(CPU *cpu, uint8_t *dest) {
-    SET_N(true);
-    SET_H((*dest & 0x0F) == 0);
-    --(*dest);
-    SET_Z(*dest == 0);
+    uint8_t lhs = (*dest)--;
+    recordLazyIncDec(cpu, LAZY_DEC, lhs, *dest);
 }
 
 static void DEC_r8(CPU *cpu, uint8_t *dest) { __DEC(cpu, dest); }
@@ -213,10 +229,8 @@ static void DEC_r16(CPU *cpu, uint16_t *dest) { --(*dest); }
 /* INC */
 
 __always_inline void __INC(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H((*dest & 0x0F) == 0x0F);
-    ++(*dest);
-    SET_Z(*dest == 0);
+    uint8_t lhs = (*dest)++;
+    recordLazyIncDec(cpu, LAZY_INC, lhs, *dest);
 }
 
 static void INC_r8(CPU *cpu, uint8_t *dest) { __INC(cpu, dest); }
@@ -232,16 +246,14 @@ static void INC_r16(CPU *cpu, uint16_t *dest) { ++(*dest); }
 /* SBC */
 
 __always_inline void __SBC(CPU *cpu, uint8_t src, bool carry) {
-    SET_N(true);
-    SET_H((cpu->a & 0x0F) < (src & 0x0F) + carry);
-    SET_C(cpu->a < src + carry);
+    uint8_t lhs = cpu->a;
     cpu->a -= src + carry;
-    SET_Z(cpu->a == 0);
+    recordLazyALU(cpu, LAZY_SUB, lhs, src, carry, cpu->a);
 }
 
-static void SBC_r8(CPU *cpu, uint8_t src) { __SBC(cpu, src, cpu->f.c); }
+static void SBC_r8(CPU *cpu, uint8_t src) { __SBC(cpu, src, flagC(cpu)); }
 
-static void SBC_u8(CPU *cpu) { __SBC(cpu, fetch(cpu), cpu->f.c); }
+static void SBC_u8(CPU *cpu) { __SBC(cpu, fetch(cpu), flagC(cpu)); }
 
 /* SUB */
 
@@ -252,6 +264,7 @@ static void SUB_u8(CPU *cpu) { __SBC(cpu, fetch(cpu), 0); }
 /* ADD */
 
 static void ADD_HL_r16(CPU *cpu, uint16_t src) {
+    materializeFlags(cpu);
     SET_N(false);
     SET_H((cpu->hl & 0x0FFF) + (src & 0x0FFF) > 0x0FFF);
     SET_C(cpu->hl + src > 0xFFFF);
@@ -261,10 +274,8 @@ static void ADD_HL_r16(CPU *cpu, uint16_t src) {
 
 static void ADD_SP_i8(CPU *cpu) {
     uint8_t imm = fetch(cpu);
-    SET_Z(false);
-    SET_N(false);
-    SET_H((cpu->sp & 0x0F) + (imm & 0x0F) > 0x0F);
-    SET_C((cpu->sp & 0xFF) + imm > 0xFF);
+    setFlags(cpu, false, false, (cpu->sp & 0x0F) + (imm & 0x0F) > 0x0F,
+             (cpu->sp & 0xFF) + imm > 0xFF);
     cpu->sp += (int8_t)imm;
 }
 
@@ -273,6 +284,7 @@ static void ADD_SP_i8(CPU *cpu) {
 /* BIT */
 
 __always_inline void __BIT(CPU *cpu, uint8_t bit, uint8_t val) {
+    materializeFlags(cpu);
     SET_Z((val & BIT(bit)) == 0);
     SET_N(false);
     SET_H(true);
@@ -289,11 +301,8 @@ static void BIT_u3_pHL(CPU *cpu, uint8_t bit) {
 /* AND */
 
 __always_inline void __AND(CPU *cpu, uint8_t src) {
-    SET_N(false);
-    SET_H(true);
-    SET_C(false);
     cpu->a &= src;
-    SET_Z(cpu->a == 0);
+    setFlags(cpu, cpu->a == 0, false, true, false);
 }
 
 static void AND_r8(CPU *cpu, uint8_t src) { __AND(cpu, src); }
@@ -303,11 +312,8 @@ static void AND_u8(CPU *cpu) { __AND(cpu, fetch(cpu)); }
 /* OR */
 
 __always_inline void __OR(CPU *cpu, uint8_t src) {
-    SET_N(false);
-    SET_H(false);
-    SET_C(false);
     cpu->a |= src;
-    SET_Z(cpu->a == 0);
+    setFlags(cpu, cpu->a == 0, false, false, false);
 }
 
 static void OR_r8(CPU *cpu, uint8_t src) { __OR(cpu, src); }
@@ -333,13 +339,11 @@ static void RES_u3_pHL(CPU *cpu, uint8_t bit) {
 /* RL */
 
 __always_inline void __RL(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
-    uint8_t c = cpu->f.c;
-    SET_C(*dest & BIT(7));
+    uint8_t c = flagC(cpu);
+    bool carry = *dest & BIT(7);
     *dest <<= 1;
     *dest |= c;
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, carry);
 }
 
 static void RL_r8(CPU *cpu, uint8_t *dest) { __RL(cpu, dest); }
@@ -358,13 +362,10 @@ static void RLA(CPU *cpu) {
 /* RLC */
 
 __always_inline void __RLC(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
     uint8_t hb = *dest >> 7;
-    SET_C(hb);
     *dest <<= 1;
     *dest |= hb;
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, hb);
 }
 
 static void RLC_r8(CPU *cpu, uint8_t *dest) { __RLC(cpu, dest); }
@@ -383,13 +384,11 @@ static void RLCA(CPU *cpu) {
 /* RR */
 
 __always_inline void __RR(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
-    uint8_t c = cpu->f.c;
-    SET_C(*dest & BIT(0));
+    uint8_t c = flagC(cpu);
+    bool carry = *dest & BIT(0);
     *dest >>= 1;
     *dest |= (c << 7);
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, carry);
 }
 
 static void RR_r8(CPU *cpu, uint8_t *dest) { __RR(cpu, dest); }
@@ -408,13 +407,10 @@ static void RRA(CPU *cpu) {
 /* RRC */
 
 __always_inline void __RRC(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
     uint8_t lb = *dest & BIT(0);
-    SET_C(lb);
     *dest >>= 1;
     *dest |= lb << 7;
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, lb);
 }
 
 static void RRC_r8(CPU *cpu, uint8_t *dest) { __RRC(cpu, dest); }
@@ -449,11 +445,9 @@ static void SET_u3_pHL(CPU *cpu, uint8_t bit) {
 /* SLA */
 
 __always_inline void __SLA(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
-    SET_C(*dest & BIT(7));
+    bool carry = *dest & BIT(7);
     *dest <<= 1;
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, carry);
 }
 
 static void SLA_r8(CPU *cpu, uint8_t *dest) { __SLA(cpu, dest); }
@@ -467,13 +461,11 @@ static void SLA_pHL(CPU *cpu) {
 /* SRA */
 
 __always_inline void __SRA(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
-    SET_C(*dest & BIT(0));
+    bool carry = *dest & BIT(0);
     uint8_t hb = *dest & BIT(7);
     *dest >>= 1;
     *dest |= hb;
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, carry);
 }
 
 static void SRA_r8(CPU *cpu, uint8_t *dest) { __SRA(cpu, dest); }
@@ -487,11 +479,9 @@ static void SRA_pHL(CPU *cpu) {
 /* SRL */
 
 __always_inline void __SRL(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
-    SET_C(*dest & BIT(0));
+    bool carry = *dest & BIT(0);
     *dest >>= 1;
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, carry);
 }
 
 static void SRL_r8(CPU *cpu, uint8_t *dest) { __SRL(cpu, dest); }
@@ -505,10 +495,7 @@ static void SRL_pHL(CPU *cpu) {
 /* SWAP */
 
 __always_inline void __SWAP(CPU *cpu, uint8_t *dest) {
-    SET_N(false);
-    SET_H(false);
-    SET_C(false);
-    SET_Z(*dest == 0);
+    setFlags(cpu, *dest == 0, false, false, false);
     *dest = (*dest << 4) | (*dest >> 4);
 }
 
@@ -523,11 +510,8 @@ static void SWAP_pHL(CPU *cpu) {
 /* XOR */
 
 __always_inline void __XOR(CPU *cpu, uint8_t src) {
-    SET_N(false);
-    SET_H(false);
-    SET_C(false);
     cpu->a ^= src;
-    SET_Z(cpu->a == 0);
+    setFlags(cpu, cpu->a == 0, false, false, false);
 }
 
 static void XOR_r8(CPU *cpu, uint8_t src) { __XOR(cpu, src); }
@@ -546,6 +530,7 @@ static void POP_r16(CPU *cpu, uint16_t *dest) {
 static void POP_AF(CPU *cpu) {
     cpu->af = (cpuRead(cpu, cpu->sp++) & 0xF0);
     cpu->a = cpuRead(cpu, cpu->sp++);
+    cpu->lazy.op = LAZY_NONE;
 }
 
 static void PUSH_r16(CPU *cpu, uint16_t src) {
@@ -559,6 +544,7 @@ static void PUSH_r16(CPU *cpu, uint16_t src) {
 static void NOP(CPU *cpu) {}
 
 static void DAA(CPU *cpu) {
+    materializeFlags(cpu);
     if (!cpu->f.n) {
         if (cpu->f.c || (cpu->a > 0x99)) {
             cpu->a += 0x60;
@@ -581,117 +567,33 @@ static void DAA(CPU *cpu) {
 
 static void HALT(CPU *cpu) { cpu->halted = true; }
 
-static void STOP(CPU *cpu) { PANIC; }
+//  Leaves the CPU halted, the run functions check fault before resuming it.
+static void raiseFault(CPU *cpu, enum CPUFault fault) {
+    cpu->fault = fault;
+    cpu->fault_pc = cpu->pc - 1;
+    cpu->halted = true;
+}
+
+static void STOP(CPU *cpu) { raiseFault(cpu, CPUFAULT_STOP); }
 
 static void CCF(CPU *cpu) {
+    materializeFlags(cpu);
     SET_N(false);
     SET_H(false);
     SET_C(!cpu->f.c);
 }
 
-static void DI(CPU *cpu) {
-    eventDI(&cpu->sched);
-    // scheduleEvent(&cpu->sched, 1, eventDI);
-}
+static void DI(CPU *cpu) { disableInterrupts(cpu); }
 
-static void EI(CPU *cpu) { scheduleEvent(&cpu->sched, 1, eEI); }
+static void EI(CPU *cpu) { enableInterrupts(cpu, true); }
 
 static void SCF(CPU *cpu) {
+    materializeFlags(cpu);
     SET_N(false);
     SET_H(false);
     SET_C(true);
 }
 
-static void CB(CPU *cpu) {
-    uint8_t opc = fetch(cpu);
-    switch (opc) {
-    case 0x00 ... 0x05:
-    case 0x07:
-        RLC_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x06:
-        RLC_pHL(cpu);
-        break;
-
-    case 0x08 ... 0x0D:
-    case 0x0F:
-        RRC_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x0E:
-        RRC_pHL(cpu);
-        break;
-
-    case 0x10 ... 0x15:
-    case 0x17:
-        RL_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x16:
-        RL_pHL(cpu);
-        break;
-
-    case 0x18 ... 0x1D:
-    case 0x1F:
-        RR_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x1E:
-        RR_pHL(cpu);
-        break;
-
-    case 0x20 ... 0x25:
-    case 0x27:
-        SLA_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x26:
-        SLA_pHL(cpu);
-        break;
-
-    case 0x28 ... 0x2D:
-    case 0x2F:
-        SRA_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x2E:
-        SRA_pHL(cpu);
-        break;
-
-    case 0x30 ... 0x35:
-    case 0x37:
-        SWAP_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x36:
-        SWAP_pHL(cpu);
-        break;
-
-    case 0x38 ... 0x3D:
-    case 0x3F:
-        SRL_r8(cpu, determineRegisterCB(cpu, opc));
-        break;
-    case 0x3E:
-        SRL_pHL(cpu);
-        break;
-
-    case 0x40 ... 0x7F:
-        if (opc % 8 != 6)
-            BIT_u3_r8(cpu, (opc - 0x40) / 8, *determineRegisterCB(cpu, opc));
-        else
-            BIT_u3_pHL(cpu, (opc - 0x40) / 8);
-        break;
-    case 0x80 ... 0xBF:
-        if (opc % 8 != 6)
-            RES_u3_r8(cpu, (opc - 0x80) / 8, determineRegisterCB(cpu, opc));
-        else
-            RES_u3_pHL(cpu, (opc - 0x80) / 8);
-        break;
-    case 0xC0 ... 0xFF:
-        if (opc % 8 != 6)
-            SET_u3_r8(cpu, (opc - 0xC0) / 8, determineRegisterCB(cpu, opc));
-        else
-            SET_u3_pHL(cpu, (opc - 0xC0) / 8);
-        break;
-    default:
-        PANIC;
-    }
-}
-
 //  CONTROL OPERATIONS
 
 static void CALL_u16(CPU *cpu) {
@@ -753,7 +655,7 @@ static void RET_cc(CPU *cpu, bool cond) {
 
 static void RETI(CPU *cpu) {
     RET(cpu);
-    EI(cpu);
+    enableInterrupts(cpu, false);
 }
 
 static void RST(CPU *cpu, RESET_VEC vec) {
@@ -762,472 +664,752 @@ static void RST(CPU *cpu, RESET_VEC vec) {
     tickM(cpu, 1);
 }
 
+//  OPCODE TABLES
+
+/*
+    Every base and CB opcode gets its own handler. Register operands are
+    expanded at compile time through the X-macro lists below, the number in
+    each entry is the operand's encoding in the opcode (6 is (HL)).
+*/
+
+#define R8_LIST(X, ...)                                                        \
+    X(__VA_ARGS__, 0, b)                                                       \
+    X(__VA_ARGS__, 1, c)                                                       \
+    X(__VA_ARGS__, 2, d)                                                       \
+    X(__VA_ARGS__, 3, e)                                                       \
+    X(__VA_ARGS__, 4, h)                                                       \
+    X(__VA_ARGS__, 5, l)                                                       \
+    X(__VA_ARGS__, 7, a)
+
+//  Second copy of R8_LIST, a macro can't expand itself when nested.
+#define R8_LIST_INNER(X, ...)                                                  \
+    X(__VA_ARGS__, 0, b)                                                       \
+    X(__VA_ARGS__, 1, c)                                                       \
+    X(__VA_ARGS__, 2, d)                                                       \
+    X(__VA_ARGS__, 3, e)                                                       \
+    X(__VA_ARGS__, 4, h)                                                       \
+    X(__VA_ARGS__, 5, l)                                                       \
+    X(__VA_ARGS__, 7, a)
+
+#define R16_LIST(X, ...)                                                       \
+    X(__VA_ARGS__, 0, bc)                                                      \
+    X(__VA_ARGS__, 1, de)                                                      \
+    X(__VA_ARGS__, 2, hl)                                                      \
+    X(__VA_ARGS__, 3, sp)
+
+#define R16_STACK_LIST(X, ...)                                                 \
+    X(__VA_ARGS__, 0, bc)                                                      \
+    X(__VA_ARGS__, 1, de)                                                      \
+    X(__VA_ARGS__, 2, hl)
+
+#define COND_LIST(X, ...)                                                      \
+    X(__VA_ARGS__, 0, NZ, !flagZ(cpu))                                         \
+    X(__VA_ARGS__, 1, Z, flagZ(cpu))                                           \
+    X(__VA_ARGS__, 2, NC, !flagC(cpu))                                         \
+    X(__VA_ARGS__, 3, C, flagC(cpu))
+
+#define ALU_LIST(X, ...)                                                       \
+    X(__VA_ARGS__, 0, ADD)                                                     \
+    X(__VA_ARGS__, 1, ADC)                                                     \
+    X(__VA_ARGS__, 2, SUB)                                                     \
+    X(__VA_ARGS__, 3, SBC)                                                     \
+    X(__VA_ARGS__, 4, AND)                                                     \
+    X(__VA_ARGS__, 5, XOR)                                                     \
+    X(__VA_ARGS__, 6, OR)                                                      \
+    X(__VA_ARGS__, 7, CP)
+
+#define SHIFT_LIST(X, ...)                                                     \
+    X(__VA_ARGS__, 0, RLC)                                                     \
+    X(__VA_ARGS__, 1, RRC)                                                     \
+    X(__VA_ARGS__, 2, RL)                                                      \
+    X(__VA_ARGS__, 3, RR)                                                      \
+    X(__VA_ARGS__, 4, SLA)                                                     \
+    X(__VA_ARGS__, 5, SRA)                                                     \
+    X(__VA_ARGS__, 6, SWAP)                                                    \
+    X(__VA_ARGS__, 7, SRL)
+
+#define BITOP_LIST(X, ...)                                                     \
+    X(__VA_ARGS__, 0, BIT)                                                     \
+    X(__VA_ARGS__, 1, RES)                                                     \
+    X(__VA_ARGS__, 2, SET)
+
+#define BIT_LIST(X, ...)                                                       \
+    X(__VA_ARGS__, 0)                                                          \
+    X(__VA_ARGS__, 1)                                                          \
+    X(__VA_ARGS__, 2)                                                          \
+    X(__VA_ARGS__, 3)                                                          \
+    X(__VA_ARGS__, 4)                                                          \
+    X(__VA_ARGS__, 5)                                                          \
+    X(__VA_ARGS__, 6)                                                          \
+    X(__VA_ARGS__, 7)
+
+static void ILLEGAL(CPU *cpu) { raiseFault(cpu, CPUFAULT_ILLEGAL); }
+
+/* CB handlers */
+
+#define DEFINE_SHIFT_R8(OI, OP, RI, R)                                         \
+    static void OP##_##R(CPU *cpu) { OP##_r8(cpu, &cpu->R); }
+#define DEFINE_SHIFT(_, OI, OP) R8_LIST(DEFINE_SHIFT_R8, OI, OP)
+SHIFT_LIST(DEFINE_SHIFT, _)
+
+#define DEFINE_BIT_R8(N, RI, R)                                                \
+    static void BIT_##N##_##R(CPU *cpu) { BIT_u3_r8(cpu, N, cpu->R); }         \
+    static void RES_##N##_##R(CPU *cpu) { RES_u3_r8(cpu, N, &cpu->R); }        \
+    static void SET_##N##_##R(CPU *cpu) { SET_u3_r8(cpu, N, &cpu->R); }
+#define DEFINE_BIT(_, N)                                                       \
+    R8_LIST(DEFINE_BIT_R8, N)                                                  \
+    static void BIT_##N##_pHL(CPU *cpu) { BIT_u3_pHL(cpu, N); }                \
+    static void RES_##N##_pHL(CPU *cpu) { RES_u3_pHL(cpu, N); }                \
+    static void SET_##N##_pHL(CPU *cpu) { SET_u3_pHL(cpu, N); }
+BIT_LIST(DEFINE_BIT, _)
+
+#define SHIFT_ENTRY_R8(OI, OP, RI, R) [OI * 8 + RI] = OP##_##R,
+#define SHIFT_ENTRY(_, OI, OP)                                                 \
+    R8_LIST(SHIFT_ENTRY_R8, OI, OP)                                            \
+    [OI * 8 + 6] = OP##_pHL,
+#define BITOP_ENTRY_R8(BI, OP, N, RI, R)                                       \
+    [0x40 + BI * 0x40 + N * 8 + RI] = OP##_##N##_##R,
+#define BITOP_ENTRY_N(BI, OP, N)                                               \
+    R8_LIST(BITOP_ENTRY_R8, BI, OP, N)                                         \
+    [0x40 + BI * 0x40 + N * 8 + 6] = OP##_##N##_pHL,
+#define BITOP_ENTRY(_, BI, OP) BIT_LIST(BITOP_ENTRY_N, BI, OP)
+
+static const OpcodeHandler CB_TABLE[256] = {
+    SHIFT_LIST(SHIFT_ENTRY, _)
+    BITOP_LIST(BITOP_ENTRY, _)
+};
+
+static void CB(CPU *cpu) { CB_TABLE[fetch(cpu)](cpu); }
+
+/* Base handlers */
+
+#define DEFINE_LD_R8_R8(DI, D, SI, S)                                          \
+    static void LD_##D##_##S(CPU *cpu) { LD_r8_r8(cpu, &cpu->D, cpu->S); }
+#define DEFINE_LD_R8(_, DI, D)                                                 \
+    R8_LIST_INNER(DEFINE_LD_R8_R8, DI, D)                                      \
+    static void LD_##D##_pHL(CPU *cpu) {                                       \
+        LD_r8_r8(cpu, &cpu->D, cpuRead(cpu, cpu->hl));                         \
+    }                                                                          \
+    static void LD_pHL_##D(CPU *cpu) { LD_pHL_r8(cpu, cpu->D); }               \
+    static void LD_##D##_u8(CPU *cpu) { LD_r8_u8(cpu, &cpu->D); }              \
+    static void INC_##D(CPU *cpu) { INC_r8(cpu, &cpu->D); }                    \
+    static void DEC_##D(CPU *cpu) { DEC_r8(cpu, &cpu->D); }
+R8_LIST(DEFINE_LD_R8, _)
+
+#define DEFINE_ALU_R8(OI, OP, RI, R)                                           \
+    static void OP##_##R(CPU *cpu) { OP##_r8(cpu, cpu->R); }
+#define DEFINE_ALU(_, OI, OP)                                                  \
+    R8_LIST(DEFINE_ALU_R8, OI, OP)                                             \
+    static void OP##_pHL(CPU *cpu) { OP##_r8(cpu, cpuRead(cpu, cpu->hl)); }
+ALU_LIST(DEFINE_ALU, _)
+
+#define DEFINE_R16(_, RI, R)                                                   \
+    static void LD_##R##_u16(CPU *cpu) { LD_r16_u16(cpu, &cpu->R); }           \
+    static void INC_##R(CPU *cpu) { INC_r16(cpu, &cpu->R); }                   \
+    static void DEC_##R(CPU *cpu) { DEC_r16(cpu, &cpu->R); }                   \
+    static void ADD_HL_##R(CPU *cpu) { ADD_HL_r16(cpu, cpu->R); }
+R16_LIST(DEFINE_R16, _)
+
+#define DEFINE_STACK(_, RI, R)                                                 \
+    static void POP_##R(CPU *cpu) { POP_r16(cpu, &cpu->R); }                   \
+    static void PUSH_##R(CPU *cpu) { PUSH_r16(cpu, cpu->R); }
+R16_STACK_LIST(DEFINE_STACK, _)
+
+static void PUSH_AF(CPU *cpu) {
+    materializeFlags(cpu);
+    PUSH_r16(cpu, cpu->af);
+}
+
+#define DEFINE_COND(_, CI, CC, EXPR)                                           \
+    static void JR_##CC##_i8(CPU *cpu) { JR_cc_i8(cpu, EXPR); }                \
+    static void JP_##CC##_u16(CPU *cpu) { JP_cc_u16(cpu, EXPR); }              \
+    static void CALL_##CC##_u16(CPU *cpu) { CALL_cc_u16(cpu, EXPR); }          \
+    static void RET_##CC(CPU *cpu) { RET_cc(cpu, EXPR); }
+COND_LIST(DEFINE_COND, _)
+
+#define DEFINE_RST(_, N) static void RST_##N(CPU *cpu) { RST(cpu, N * 8); }
+BIT_LIST(DEFINE_RST, _)
+
+static void LD_A_pBC(CPU *cpu) { LD_A_pr16(cpu, cpu->bc); }
+
+static void LD_A_pDE(CPU *cpu) { LD_A_pr16(cpu, cpu->de); }
+
+static void LD_pBC_A(CPU *cpu) { LD_pr16_A(cpu, cpu->bc); }
+
+static void LD_pDE_A(CPU *cpu) { LD_pr16_A(cpu, cpu->de); }
+
+#define LD_ENTRY_R8_R8(DI, D, SI, S) [0x40 + DI * 8 + SI] = LD_##D##_##S,
+#define LD_ENTRY(_, DI, D)                                                     \
+    R8_LIST_INNER(LD_ENTRY_R8_R8, DI, D)                                       \
+    [0x40 + DI * 8 + 6] = LD_##D##_pHL,                                        \
+    [0x70 + DI] = LD_pHL_##D,                                                  \
+    [0x06 + DI * 8] = LD_##D##_u8,                                             \
+    [0x04 + DI * 8] = INC_##D,                                                 \
+    [0x05 + DI * 8] = DEC_##D,
+#define ALU_ENTRY_R8(OI, OP, RI, R) [0x80 + OI * 8 + RI] = OP##_##R,
+#define ALU_ENTRY(_, OI, OP)                                                   \
+    R8_LIST(ALU_ENTRY_R8, OI, OP)                                              \
+    [0x80 + OI * 8 + 6] = OP##_pHL,                                            \
+    [0xC6 + OI * 8] = OP##_u8,
+#define R16_ENTRY(_, RI, R)                                                    \
+    [0x01 + RI * 16] = LD_##R##_u16,                                           \
+    [0x03 + RI * 16] = INC_##R,                                                \
+    [0x09 + RI * 16] = ADD_HL_##R,                                             \
+    [0x0B + RI * 16] = DEC_##R,
+#define STACK_ENTRY(_, RI, R)                                                  \
+    [0xC1 + RI * 16] = POP_##R,                                                \
+    [0xC5 + RI * 16] = PUSH_##R,
+#define COND_ENTRY(_, CI, CC, EXPR)                                            \
+    [0xC0 + CI * 8] = RET_##CC,                                                \
+    [0xC2 + CI * 8] = JP_##CC##_u16,                                           \
+    [0xC4 + CI * 8] = CALL_##CC##_u16,                                         \
+    [0x20 + CI * 8] = JR_##CC##_i8,
+#define RST_ENTRY(_, N) [0xC7 + N * 8] = RST_##N,
+
+static const OpcodeHandler OPCODE_TABLE[256] = {
+    R8_LIST(LD_ENTRY, _)
+    ALU_LIST(ALU_ENTRY, _)
+    R16_LIST(R16_ENTRY, _)
+    R16_STACK_LIST(STACK_ENTRY, _)
+    STACK_ENTRY(_, 3, AF)
+    COND_LIST(COND_ENTRY, _)
+    BIT_LIST(RST_ENTRY, _)
+
+    [0x00] = NOP,
+    [0x02] = LD_pBC_A,
+    [0x07] = RLCA,
+    [0x08] = LD_pu16_SP,
+    [0x0A] = LD_A_pBC,
+    [0x0F] = RRCA,
+    [0x10] = STOP,
+    [0x12] = LD_pDE_A,
+    [0x17] = RLA,
+    [0x18] = JR_i8,
+    [0x1A] = LD_A_pDE,
+    [0x1F] = RRA,
+    [0x22] = LD_pHLi_A,
+    [0x27] = DAA,
+    [0x2A] = LD_A_pHLi,
+    [0x2F] = CPL,
+    [0x32] = LD_pHLd_A,
+    [0x34] = INC_pHL,
+    [0x35] = DEC_pHL,
+    [0x36] = LD_pHL_u8,
+    [0x37] = SCF,
+    [0x3A] = LD_A_pHLd,
+    [0x3F] = CCF,
+    [0x76] = HALT,
+    [0xC3] = JP_u16,
+    [0xC9] = RET,
+    [0xCB] = CB,
+    [0xCD] = CALL_u16,
+    [0xD3] = ILLEGAL,
+    [0xD9] = RETI,
+    [0xDB] = ILLEGAL,
+    [0xDD] = ILLEGAL,
+    [0xE0] = LDH_pu8_A,
+    [0xE2] = LDH_pC_A,
+    [0xE3] = ILLEGAL,
+    [0xE4] = ILLEGAL,
+    [0xE8] = ADD_SP_i8,
+    [0xE9] = JP_HL,
+    [0xEA] = LD_pu16_A,
+    [0xEB] = ILLEGAL,
+    [0xEC] = ILLEGAL,
+    [0xED] = ILLEGAL,
+    [0xF0] = LDH_A_pu8,
+    [0xF2] = LDH_A_pC,
+    [0xF3] = DI,
+    [0xF4] = ILLEGAL,
+    [0xF8] = LD_HL_SPi8,
+    [0xF9] = LD_SP_HL,
+    [0xFA] = LD_A_pu16,
+    [0xFB] = EI,
+    [0xFC] = ILLEGAL,
+    [0xFD] = ILLEGAL,
+};
+
 static void fetchAndExecuteInstruction(CPU *cpu) {
-    uint8_t opcode = fetch(cpu);
+    ++cpu->instructions;
+    OPCODE_TABLE[fetch(cpu)](cpu);
+}
+
+//  CACHED INTERPRETER
+
+static const uint8_t OPCODE_LENGTH[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 0x00
+    1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x10
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x20
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xC0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1, // 0xD0
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // 0xE0
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // 0xF0
+};
+
+//  M-cycles each handler ticks at most, including the opcode fetch.
+//  CB-prefixed ops are handled by cbCycles.
+static const uint8_t OPCODE_CYCLES[256] = {
+    1, 3, 2, 1, 1, 1, 2, 1, 5, 2, 2, 1, 1, 1, 2, 1, // 0x00
+    1, 3, 2, 1, 1, 1, 2, 1, 3, 2, 2, 1, 1, 1, 2, 1, // 0x10
+    3, 3, 2, 1, 1, 1, 2, 1, 3, 2, 2, 1, 1, 1, 2, 1, // 0x20
+    3, 3, 2, 1, 3, 3, 3, 1, 3, 2, 2, 1, 1, 1, 2, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x50
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x60
+    2, 2, 2, 2, 2, 2, 1, 2, 1, 1, 1, 1, 1, 1, 2, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0xB0
+    5, 3, 4, 4, 7, 4, 2, 5, 5, 4, 4, 1, 7, 7, 2, 5, // 0xC0
+    5, 3, 4, 1, 7, 4, 2, 5, 5, 4, 4, 1, 7, 1, 2, 5, // 0xD0
+    3, 3, 2, 1, 1, 4, 2, 5, 2, 1, 4, 1, 1, 1, 2, 5, // 0xE0
+    3, 3, 2, 1, 1, 4, 2, 5, 3, 2, 4, 1, 1, 1, 2, 5, // 0xF0
+};
+
+//  Register ops take 2, BIT n,(HL) 3 and the other (HL) ops 4.
+static uint8_t cbCycles(uint8_t opcode) {
+    if ((opcode & 0x07) != 6)
+        return 2;
+    return (opcode & 0xC0) == 0x40 ? 3 : 4;
+}
+
+static bool endsBlock(uint8_t opcode) {
     switch (opcode) {
-    case 0x00:
-        NOP(cpu);
-        break;
-    case 0x01:
-        LD_r16_u16(cpu, &cpu->bc);
-        break;
-    case 0x02:
-        LD_pr16_A(cpu, cpu->bc);
-        break;
-    case 0x03:
-        INC_r16(cpu, &cpu->bc);
-        break;
-    case 0x04:
-        INC_r8(cpu, &cpu->b);
-        break;
-    case 0x05:
-        DEC_r8(cpu, &cpu->b);
-        break;
-    case 0x06:
-        LD_r8_u8(cpu, &cpu->b);
-        break;
-    case 0x07:
-        RLCA(cpu);
-        break;
-    case 0x08:
-        LD_pu16_SP(cpu);
-        break;
-    case 0x09:
-        ADD_HL_r16(cpu, cpu->bc);
-        break;
-    case 0x0A:
-        LD_A_pr16(cpu, cpu->bc);
-        break;
-    case 0x0B:
-        DEC_r16(cpu, &cpu->bc);
-        break;
-    case 0x0C:
-        INC_r8(cpu, &cpu->c);
-        break;
-    case 0x0D:
-        DEC_r8(cpu, &cpu->c);
-        break;
-    case 0x0E:
-        LD_r8_u8(cpu, &cpu->c);
-        break;
-    case 0x0F:
-        RRCA(cpu);
-        break;
-
-    case 0x10:
-        STOP(cpu);
-        break;
-    case 0x11:
-        LD_r16_u16(cpu, &cpu->de);
-        break;
-    case 0x12:
-        LD_pr16_A(cpu, cpu->de);
-        break;
-    case 0x13:
-        INC_r16(cpu, &cpu->de);
-        break;
-    case 0x14:
-        INC_r8(cpu, &cpu->d);
-        break;
-    case 0x15:
-        DEC_r8(cpu, &cpu->d);
-        break;
-    case 0x16:
-        LD_r8_u8(cpu, &cpu->d);
-        break;
-    case 0x17:
-        RLA(cpu);
-        break;
+    case 0x10: //  STOP
     case 0x18:
-        JR_i8(cpu);
-        break;
-    case 0x19:
-        ADD_HL_r16(cpu, cpu->de);
-        break;
-    case 0x1A:
-        LD_A_pr16(cpu, cpu->de);
-        break;
-    case 0x1B:
-        DEC_r16(cpu, &cpu->de);
-        break;
-    case 0x1C:
-        INC_r8(cpu, &cpu->e);
-        break;
-    case 0x1D:
-        DEC_r8(cpu, &cpu->e);
-        break;
-    case 0x1E:
-        LD_r8_u8(cpu, &cpu->e);
-        break;
-    case 0x1F:
-        RRA(cpu);
-        break;
-
     case 0x20:
-        JR_cc_i8(cpu, !cpu->f.z);
-        break;
-    case 0x21:
-        LD_r16_u16(cpu, &cpu->hl);
-        break;
-    case 0x22:
-        LD_pHLi_A(cpu);
-        break;
-    case 0x23:
-        INC_r16(cpu, &cpu->hl);
-        break;
-    case 0x24:
-        INC_r8(cpu, &cpu->h);
-        break;
-    case 0x25:
-        DEC_r8(cpu, &cpu->h);
-        break;
-    case 0x26:
-        LD_r8_u8(cpu, &cpu->h);
-        break;
-    case 0x27:
-        DAA(cpu);
-        break;
     case 0x28:
-        JR_cc_i8(cpu, cpu->f.z);
-        break;
-    case 0x29:
-        ADD_HL_r16(cpu, cpu->hl);
-        break;
-    case 0x2A:
-        LD_A_pHLi(cpu);
-        break;
-    case 0x2B:
-        DEC_r16(cpu, &cpu->hl);
-        break;
-    case 0x2C:
-        INC_r8(cpu, &cpu->l);
-        break;
-    case 0x2D:
-        DEC_r8(cpu, &cpu->l);
-        break;
-    case 0x2E:
-        LD_r8_u8(cpu, &cpu->l);
-        break;
-    case 0x2F:
-        CPL(cpu);
-        break;
-
     case 0x30:
-        JR_cc_i8(cpu, !cpu->f.c);
-        break;
-    case 0x31:
-        LD_SP_u16(cpu);
-        break;
-    case 0x32:
-        LD_pHLd_A(cpu);
-        break;
-    case 0x33:
-        INC_r16(cpu, &cpu->sp);
-        break;
-    case 0x34:
-        INC_pHL(cpu);
-        break;
-    case 0x35:
-        DEC_pHL(cpu);
-        break;
-    case 0x36:
-        LD_pHL_u8(cpu);
-        break;
-    case 0x37:
-        SCF(cpu);
-        break;
-    case 0x38:
-        JR_cc_i8(cpu, cpu->f.c);
-        break;
-    case 0x39:
-        ADD_HL_r16(cpu, cpu->sp);
-        break;
-    case 0x3A:
-        LD_A_pHLd(cpu);
-        break;
-    case 0x3B:
-        DEC_r16(cpu, &cpu->sp);
-        break;
-    case 0x3C:
-        INC_r8(cpu, &cpu->a);
-        break;
-    case 0x3D:
-        DEC_r8(cpu, &cpu->a);
-        break;
-    case 0x3E:
-        LD_r8_u8(cpu, &cpu->a);
-        break;
-    case 0x3F:
-        CCF(cpu);
-        break;
-
-    case 0x40 ... 0x47:
-        LD_r8_r8(cpu, &cpu->b, determineRegister(cpu, opcode));
-        break;
-    case 0x48 ... 0x4F:
-        LD_r8_r8(cpu, &cpu->c, determineRegister(cpu, opcode));
-        break;
-    case 0x50 ... 0x57:
-        LD_r8_r8(cpu, &cpu->d, determineRegister(cpu, opcode));
-        break;
-    case 0x58 ... 0x5F:
-        LD_r8_r8(cpu, &cpu->e, determineRegister(cpu, opcode));
-        break;
-    case 0x60 ... 0x67:
-        LD_r8_r8(cpu, &cpu->h, determineRegister(cpu, opcode));
-        break;
-    case 0x68 ... 0x6F:
-        LD_r8_r8(cpu, &cpu->l, determineRegister(cpu, opcode));
-        break;
-    case 0x70 ... 0x77:
-        if (opcode % 8 == 6)
-            HALT(cpu);
-        else
-            LD_pHL_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0x78 ... 0x7F:
-        LD_r8_r8(cpu, &cpu->a, determineRegister(cpu, opcode));
-        break;
-
-    case 0x80 ... 0x87:
-        ADD_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0x88 ... 0x8F:
-        ADC_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0x90 ... 0x97:
-        SUB_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0x98 ... 0x9F:
-        SBC_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0xA0 ... 0xA7:
-        AND_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0xA8 ... 0xAF:
-        XOR_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0xB0 ... 0xB7:
-        OR_r8(cpu, determineRegister(cpu, opcode));
-        break;
-    case 0xB8 ... 0xBF:
-        CP_r8(cpu, determineRegister(cpu, opcode));
-        break;
-
+    case 0x38: //  JR
+    case 0x76: //  HALT
     case 0xC0:
-        RET_cc(cpu, !cpu->f.z);
-        break;
-    case 0xC1:
-        POP_r16(cpu, &cpu->bc);
-        break;
-    case 0xC2:
-        JP_cc_u16(cpu, !cpu->f.z);
-        break;
-    case 0xC3:
-        JP_u16(cpu);
-        break;
-    case 0xC4:
-        CALL_cc_u16(cpu, !cpu->f.z);
-        break;
-    case 0xC5:
-        PUSH_r16(cpu, cpu->bc);
-        break;
-    case 0xC6:
-        ADD_u8(cpu);
-        break;
-    case 0xC7:
-        RST(cpu, _V00h);
-        break;
     case 0xC8:
-        RET_cc(cpu, cpu->f.z);
-        break;
     case 0xC9:
-        RET(cpu);
-        break;
+    case 0xD0:
+    case 0xD8:
+    case 0xD9: //  RET, RETI
+    case 0xC2:
+    case 0xC3:
     case 0xCA:
-        JP_cc_u16(cpu, cpu->f.z);
-        break;
-    case 0xCB:
-        CB(cpu);
-        break;
+    case 0xD2:
+    case 0xDA:
+    case 0xE9: //  JP
+    case 0xC4:
     case 0xCC:
-        CALL_cc_u16(cpu, cpu->f.z);
-        break;
     case 0xCD:
-        CALL_u16(cpu);
-        break;
-    case 0xCE:
-        ADC_u8(cpu);
-        break;
-    case 0xCF:
-        RST(cpu, _V08h);
-        break;
-
-    case 0xD0:
-        RET_cc(cpu, !cpu->f.c);
-        break;
-    case 0xD1:
-        POP_r16(cpu, &cpu->de);
-        break;
-    case 0xD2:
-        JP_cc_u16(cpu, !cpu->f.c);
-        break;
-    case 0xD3:
-        PANIC;
-        break;
     case 0xD4:
-        CALL_cc_u16(cpu, !cpu->f.c);
-        break;
-    case 0xD5:
-        PUSH_r16(cpu, cpu->de);
-        break;
-    case 0xD6:
-        SUB_u8(cpu);
-        break;
+    case 0xDC: //  CALL
+    case 0xC7:
+    case 0xCF:
     case 0xD7:
-        RST(cpu, _V10h);
-        break;
-    case 0xD8:
-        RET_cc(cpu, cpu->f.c);
-        break;
-    case 0xD9:
-        RETI(cpu);
-        break;
-    case 0xDA:
-        JP_cc_u16(cpu, cpu->f.c);
-        break;
-    case 0xDB:
-        PANIC;
-        break;
-    case 0xDC:
-        CALL_cc_u16(cpu, cpu->f.c);
-        break;
-    case 0xDD:
-        PANIC;
-        break;
-    case 0xDE:
-        SBC_u8(cpu);
-        break;
     case 0xDF:
-        RST(cpu, _V18h);
-        break;
-
-    case 0xE0:
-        LDH_pu8_A(cpu);
-        break;
-    case 0xE1:
-        POP_r16(cpu, &cpu->hl);
-        break;
-    case 0xE2:
-        LDH_pC_A(cpu);
-        break;
-    case 0xE3:
-        PANIC;
-        break;
-    case 0xE4:
-        PANIC;
-        break;
-    case 0xE5:
-        PUSH_r16(cpu, cpu->hl);
-        break;
-    case 0xE6:
-        AND_u8(cpu);
-        break;
     case 0xE7:
-        RST(cpu, _V20h);
-        break;
-    case 0xE8:
-        ADD_SP_i8(cpu);
-        break;
-    case 0xE9:
-        JP_HL(cpu);
-        break;
-    case 0xEA:
-        LD_pu16_A(cpu);
-        break;
-    case 0xEB:
-        PANIC;
-        break;
-    case 0xEC:
-        PANIC;
-        break;
-    case 0xED:
-        PANIC;
-        break;
-    case 0xEE:
-        XOR_u8(cpu);
-        break;
     case 0xEF:
-        RST(cpu, _V28h);
-        break;
-
-    case 0xF0:
-        LDH_A_pu8(cpu);
-        break;
-    case 0xF1:
-        POP_AF(cpu);
-        break;
-    case 0xF2:
-        LDH_A_pC(cpu);
-        break;
-    case 0xF3:
-        DI(cpu);
-        break;
-    case 0xF4:
-        PANIC;
-        break;
-    case 0xF5:
-        PUSH_r16(cpu, cpu->af);
-        break;
-    case 0xF6:
-        OR_u8(cpu);
-        break;
     case 0xF7:
-        RST(cpu, _V30h);
-        break;
-    case 0xF8:
-        LD_HL_SPi8(cpu);
-        break;
-    case 0xF9:
-        LD_SP_HL(cpu);
-        break;
-    case 0xFA:
-        LD_A_pu16(cpu);
-        break;
-    case 0xFB:
-        EI(cpu);
-        break;
-    case 0xFC:
-        PANIC;
-        break;
-    case 0xFD:
-        PANIC;
-        break;
-    case 0xFE:
-        CP_u8(cpu);
-        break;
-    case 0xFF:
-        RST(cpu, _V38h);
-        break;
-    default:
-        PANIC;
+    case 0xFF: //  RST
+    case 0xF3:
+    case 0xFB: //  DI, EI
+        return true;
     }
+    return OPCODE_TABLE[opcode] == ILLEGAL;
+}
+
+static bool isCacheable(uint16_t adr) {
+    //  Fetching 0x100 unmounts the boot ROM, so it's always interpreted.
+    switch (adr) {
+    case 0x0000 ... 0x00FF:
+    case 0x0101 ... 0x7FFF:
+    case 0xC000 ... 0xFDFF:
+    case 0xFF80 ... 0xFFFE:
+        return true;
+    }
+    return false;
+}
+
+uint8_t decodeBlock(CPU *cpu, uint16_t pc, struct MicroOp *ops) {
+    uint8_t count = 0;
+    while (count < BLOCK_MAX_OPS && isCacheable(pc)) {
+        uint8_t opcode = memRead(&cpu->memory, pc);
+        uint8_t length = OPCODE_LENGTH[opcode];
+        uint16_t last = pc + length - 1;
+        if (last < pc || !isCacheable(last))
+            break;
+        struct MicroOp *op = &ops[count++];
+        op->pc = pc;
+        op->length = length;
+        op->opcode = opcode;
+        op->operand = 0;
+        for (uint8_t i = 1; i < length; ++i)
+            op->operand |= memRead(&cpu->memory, pc + i) << (i - 1) * 8;
+        if (opcode == 0xCB) {
+            op->func = CB_TABLE[op->operand];
+            op->prefix = 2;
+            op->cycles = cbCycles(op->operand);
+        } else {
+            op->func = OPCODE_TABLE[opcode];
+            op->prefix = 1;
+            op->cycles = OPCODE_CYCLES[opcode];
+        }
+        pc += length;
+        if (endsBlock(opcode))
+            break;
+    }
+    return count;
+}
+
+static struct CachedBlock *fetchBlock(CPU *cpu) {
+    BlockCache *cache = &cpu->block_cache;
+    struct CachedBlock *block = lookupBlock(cache, cpu->pc);
+    if (!block) {
+        struct MicroOp ops[BLOCK_MAX_OPS];
+        uint8_t count = decodeBlock(cpu, cpu->pc, ops);
+        if (!count)
+            return NULL;
+        block = insertBlock(cache, cpu->memory.code_pages, cpu->pc, ops,
+                            count);
+    }
+    return block;
+}
+
+static void runBlock(CPU *cpu, const struct CachedBlock *block) {
+    //  Stop as soon as anything diverts control flow or frees the block.
+    uint32_t generation = cpu->block_cache.generation;
+    const struct MicroOp *op = block->ops;
+    const struct MicroOp *end = op + block->op_count;
+    for (; op != end; ++op) {
+        uint16_t next_pc = op->pc + op->length;
+        tickM(cpu, op->prefix);
+        cpu->pc += op->prefix;
+        op->func(cpu);
+        ++cpu->instructions;
+        if (cpu->halted || cpu->pc != next_pc ||
+            cpu->block_cache.generation != generation ||
+            cpu->t_cycles >= cpu->sched.next_deadline ||
+            cpu->interrupts.pending)
+            return;
+    }
+}
+
+static void runCachedBlock(CPU *cpu) {
+    struct CachedBlock *block = fetchBlock(cpu);
+    if (block)
+        runBlock(cpu, block);
+    else
+        fetchAndExecuteInstruction(cpu);
+}
+
+static void runCompiledBlock(CPU *cpu) {
+    struct CachedBlock *block = fetchBlock(cpu);
+    if (!block) {
+        fetchAndExecuteInstruction(cpu);
+        return;
+    }
+    //  Self-modifying code stays on the cached interpreter.
+    if (!block->native && isBlockCompilable(&cpu->block_cache, block))
+        block->native = compileBlock(&cpu->dynarec, &cpu->block_cache, block);
+    //  Native code only checks the deadline on entry, so blocks that could
+    //  reach it or start with an interrupt pending are run op by op.
+    if (block->native && !cpu->interrupts.pending &&
+        cpu->t_cycles + block->cycles <= cpu->sched.next_deadline)
+        block->native(cpu);
+    else
+        runBlock(cpu, block);
+}
+
+//  IDLE LOOPS
+
+//  DIV and TIMA change without any event, a loop polling them never settles.
+static bool isIdlePollAddress(uint16_t adr) {
+    if (adr >= TIMER_DIV && adr <= TIMER_TIMA)
+        return false;
+    return (adr >= IO_BEG && adr <= IO_END) || adr == IE;
+}
+
+/*
+    Returns the M-cycles of one iteration of the loop at pc, or 0 unless its
+    body only reads IO registers into A, computes flags and branches back. Ops
+    that modify A must come after A was loaded so the loop can settle.
+*/
+static uint8_t idleLoopCycles(CPU *cpu, uint16_t pc) {
+    uint16_t adr = pc;
+    uint8_t cycles = 0;
+    bool loaded_a = false;
+    while ((uint16_t)(adr - pc) < IDLE_LOOP_MAX_BYTES && isCacheable(adr)) {
+        uint8_t opcode = memRead(&cpu->memory, adr);
+        uint8_t length = OPCODE_LENGTH[opcode];
+        uint16_t last = adr + length - 1;
+        if (last < adr || !isCacheable(last))
+            return 0;
+        uint8_t u8 = memRead(&cpu->memory, adr + 1);
+        uint16_t u16 = u8 | memRead(&cpu->memory, adr + 2) << 8;
+        adr += length;
+        switch (opcode) {
+        case 0x00: //  NOP
+            cycles += 1;
+            break;
+        case 0xF0: //  LD A, (FF00+u8)
+            if (!isIdlePollAddress(0xFF00 + u8))
+                return 0;
+            loaded_a = true;
+            cycles += 3;
+            break;
+        case 0xF2: //  LD A, (FF00+C)
+            if (!isIdlePollAddress(0xFF00 + cpu->c))
+                return 0;
+            loaded_a = true;
+            cycles += 2;
+            break;
+        case 0xFA: //  LD A, (u16)
+            if (!isIdlePollAddress(u16))
+                return 0;
+            loaded_a = true;
+            cycles += 4;
+            break;
+        case 0xAF: //  XOR A
+            loaded_a = true;
+            cycles += 1;
+            break;
+        case 0xA7:
+        case 0xB7:
+        case 0xBF: //  AND A, OR A, CP A
+            cycles += 1;
+            break;
+        case 0xFE: //  CP u8
+            cycles += 2;
+            break;
+        case 0xC6:
+        case 0xD6:
+        case 0xE6:
+        case 0xEE:
+        case 0xF6: //  ADD, SUB, AND, XOR, OR u8
+            if (!loaded_a)
+                return 0;
+            cycles += 2;
+            break;
+        case 0xCB: //  BIT n, A
+            if ((u8 & 0xC7) != 0x47)
+                return 0;
+            cycles += 2;
+            break;
+        case 0x18:
+        case 0x20:
+        case 0x28:
+        case 0x30:
+        case 0x38: //  JR
+            return (uint16_t)(adr + (int8_t)u8) == pc ? cycles + 3 : 0;
+        case 0xC2:
+        case 0xC3:
+        case 0xCA:
+        case 0xD2:
+        case 0xDA: //  JP
+            return u16 == pc ? cycles + 4 : 0;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+    Called when control went back to cpu->pc. Once an idle loop has run a full
+    iteration without changing state, every iteration until the next
+    scheduled event is identical and is skipped.
+*/
+static void skipIdleLoop(CPU *cpu, uint64_t limit) {
+    uint64_t deadline = cpu->sched.next_deadline;
+    //  An interrupt about to be taken leaves the loop anyway.
+    if (deadline == SCHED_NEVER || cpu->interrupts.pending)
+        return;
+    struct IdleLoop *loop = &cpu->idle_loop;
+    syncFlags(cpu);
+    if (loop->pc != cpu->pc || loop->deadline != deadline) {
+        loop->pc = cpu->pc;
+        loop->deadline = deadline;
+        loop->af = cpu->af;
+        loop->cycles = idleLoopCycles(cpu, cpu->pc);
+        return;
+    }
+    if (!loop->cycles)
+        return;
+    if (loop->af != cpu->af) {
+        loop->af = cpu->af;
+        return;
+    }
+    //  Limited to limit as well, so callers running a set number of cycles
+    //  get control back on time.
+    uint64_t end = deadline < limit ? deadline : limit;
+    if (end <= cpu->t_cycles)
+        return;
+    //  Stop short of the deadline so the event fires on the same cycle.
+    uint64_t period = loop->cycles * 4;
+    uint64_t skipped = (end - 1 - cpu->t_cycles) / period * period;
+    cpu->t_cycles += skipped;
+    cpu->idle_skipped_cycles += skipped;
 }
 
 CPU *createCPU(void) {
     CPU *cpu = malloc(sizeof(*cpu));
     memset(cpu, 0, sizeof(*cpu));
     initScheduler(&cpu->sched, cpu);
-    cpu->memory.sched = &cpu->sched;
+    initMemory(&cpu->memory, &cpu->sched);
+    initPPU(&cpu->ppu);
     return cpu;
 }
 
-void destroyCPU(CPU *cpu) { free(cpu); }
+void destroyCPU(CPU *cpu) {
+    if (cpu->ppu.worker)
+        destroyRenderWorker(cpu->ppu.worker);
+    destroyMemory(&cpu->memory);
+    destroyDynarec(&cpu->dynarec);
+    destroyBlockCache(&cpu->block_cache);
+    free(cpu);
+}
+
+void resetCPU(CPU *cpu) {
+    BlockCache block_cache = cpu->block_cache;
+    Dynarec dynarec = cpu->dynarec;
+    enum ExecMode exec_mode = cpu->exec_mode;
+    bool idle_skip = cpu->idle_skip;
+    bool render_thread = cpu->ppu.render_thread;
+    if (cpu->ppu.worker)
+        destroyRenderWorker(cpu->ppu.worker);
+    destroyMemory(&cpu->memory);
+    memset(cpu, 0, sizeof(*cpu));
+    initScheduler(&cpu->sched, cpu);
+    initMemory(&cpu->memory, &cpu->sched);
+    initPPU(&cpu->ppu);
+    cpu->block_cache = block_cache;
+    if (cpu->block_cache.blocks)
+        flushBlockCache(&cpu->block_cache, cpu->memory.code_pages);
+    memset(cpu->block_cache.invalidations, 0,
+           sizeof(cpu->block_cache.invalidations));
+    //  Flushing dropped every native block.
+    cpu->dynarec = dynarec;
+    cpu->dynarec.used = 0;
+    cpu->exec_mode = exec_mode;
+    cpu->idle_skip = idle_skip;
+    cpu->ppu.render_thread = render_thread;
+}
+
+void setExecMode(CPU *cpu, enum ExecMode mode) {
+    if (mode == EXECMODE_DYNAREC && !initDynarec(&cpu->dynarec))
+        mode = EXECMODE_CACHED;
+    if (mode != EXECMODE_INTERPRETER)
+        initBlockCache(&cpu->block_cache);
+    cpu->exec_mode = mode;
+}
+
+//  Nothing but a scheduled event can raise an interrupt to end HALT, so skip
+//  straight to the next one, rounded up to the M-cycle it would have fired
+//  on. Never past limit, callers running a set number of cycles get back
+//  control on time.
+static void fastForwardHalt(CPU *cpu, uint64_t limit) {
+    size_t cycles = 1;
+    uint64_t deadline = cpu->sched.next_deadline < limit
+                            ? cpu->sched.next_deadline
+                            : limit;
+    if (deadline != SCHED_NEVER && deadline > cpu->t_cycles)
+        cycles = (deadline - cpu->t_cycles + 3) / 4;
+    tickM(cpu, cycles);
+    tickScheduler(&cpu->sched, cpu->t_cycles);
+}
+
+void setIdleSkip(CPU *cpu, bool enable) {
+    cpu->idle_skip = enable;
+    memset(&cpu->idle_loop, 0, sizeof(cpu->idle_loop));
+}
+
+void setRenderThread(CPU *cpu, bool enable) {
+    cpu->ppu.render_thread = enable;
+}
+
+/*
+    Runs instructions back to back until the next event is due or limit is
+    reached, then runs the due events. IO writes that schedule an earlier
+    event lower next_deadline, which is re-read after every instruction.
+    Interrupts are only looked at when their pending mask is set.
+*/
+static void runUntilDeadline(CPU *cpu, uint64_t limit) {
+    if (cpu->halted) {
+        if (cpu->fault)
+            return;
+        if (!wakingInterrupts(&cpu->interrupts)) {
+            fastForwardHalt(cpu, limit);
+            return;
+        }
+        cpu->halted = false;
+    }
+    while (cpu->t_cycles < cpu->sched.next_deadline &&
+           cpu->t_cycles < limit) {
+        if (cpu->interrupts.pending)
+            serviceInterrupts(cpu);
+        uint16_t start_pc = cpu->pc;
+        if (cpu->exec_mode == EXECMODE_DYNAREC)
+            runCompiledBlock(cpu);
+        else if (cpu->exec_mode == EXECMODE_CACHED)
+            runCachedBlock(cpu);
+        else
+            fetchAndExecuteInstruction(cpu);
+        if (cpu->halted)
+            break;
+        if (cpu->idle_skip &&
+            (uint16_t)(start_pc - cpu->pc) < IDLE_LOOP_MAX_BYTES)
+            skipIdleLoop(cpu, limit);
+    }
+    tickScheduler(&cpu->sched, cpu->t_cycles);
+}
+
+void setFrameCallback(CPU *cpu, FrameCallback callback, void *user) {
+    cpu->ppu.on_frame = callback;
+    cpu->ppu.frame_user = user;
+}
+
+//  Leaves registers and the PPU exact for callers inspecting the state.
+static void finishRun(CPU *cpu) {
+    syncFlags(cpu);
+    ppuSync(&cpu->ppu, &cpu->memory, cpu->t_cycles);
+}
 
 void updateCPU(CPU *cpu) {
-    if (!cpu->halted)
-        fetchAndExecuteInstruction(cpu);
-    else
-        tickM(cpu, 1);
-    tickScheduler(&cpu->sched);
-}
\ No newline at end of file
+    runUntilDeadline(cpu, SCHED_NEVER);
+    finishRun(cpu);
+}
+
+void runUntilFrame(CPU *cpu) {
+    uint64_t frame = cpu->ppu.frame_count;
+    uint64_t end = cpu->t_cycles + FRAME_MAX_CYCLES;
+    while (cpu->ppu.frame_count == frame && !cpu->fault &&
+           ((cpu->ppu.lcdc & BIT(7)) || cpu->t_cycles < end)) {
+        //  Bounded even past end, the LCD may be switched off mid-run.
+        runUntilDeadline(cpu, cpu->t_cycles < end
+                                  ? end
+                                  : cpu->t_cycles + FRAME_MAX_CYCLES);
+    }
+    finishRun(cpu);
+}
+
+void runCycles(CPU *cpu, uint64_t cycles) {
+    uint64_t end = cpu->t_cycles + cycles;
+    while (cpu->t_cycles < end && !cpu->fault)
+        runUntilDeadline(cpu, end);
+    finishRun(cpu);
+}
+
+void setJoypad(CPU *cpu, uint8_t buttons) {
+    //  P1 lines only ever get pulled low by a newly pressed button.
+    if (buttons & ~cpu->memory.joypad)
+        requestInterrupt(cpu, INTERRUPT_JOYPAD);
+    cpu->memory.joypad = buttons;
+    //  A loop polling P1 may no longer be idle.
+    memset(&cpu->idle_loop, 0, sizeof(cpu->idle_loop));
+}
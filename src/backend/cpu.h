@@ -8,7 +8,12 @@
 #include <utility.h>
 #include "memory.h"
 #include "ppu.h"
+#include "timer.h"
+#include "interrupts.h"
 #include "scheduler.h"
+#include "blockcache.h"
+#include "dynarec.h"
+#include "profile.h"
 
 #define REGISTER_UNION(UPPER, LOWER)                                           \
     union {                                                                    \
@@ -19,16 +24,61 @@
         uint16_t UPPER##LOWER;                                                 \
     }
 
+enum ExecMode {
+    EXECMODE_INTERPRETER = 0,
+    EXECMODE_CACHED,
+    EXECMODE_DYNAREC,
+};
+
+//  Instructions that stop the emulated CPU for good. The run functions
+//  return as soon as one was hit, instead of taking the process down.
+enum CPUFault {
+    CPUFAULT_NONE = 0,
+    CPUFAULT_STOP,
+    CPUFAULT_ILLEGAL,
+};
+
+enum LazyFlagOp {
+    LAZY_NONE = 0,
+    LAZY_ADD,
+    LAZY_SUB,
+    LAZY_INC,
+    LAZY_DEC,
+};
+
+//  Operands and result of the last flag-setting ALU op not yet folded into f.
+struct LazyFlags {
+    uint8_t op;
+    uint8_t lhs, rhs, res;
+    bool carry;
+};
+
+#define IDLE_LOOP_MAX_BYTES 16
+
+//  Last backward branch target, a loop is only skipped once two consecutive
+//  iterations start in the same state.
+struct IdleLoop {
+    uint64_t deadline;
+    uint16_t pc;
+    uint16_t af;
+    //  M-cycles per iteration, 0 if the loop has side effects.
+    uint8_t cycles;
+};
+
 typedef struct CPU {
     union {
         struct {
-            struct {
-                uint8_t unused : 4, c : 1, h : 1, n : 1, z : 1;
-            } f;
+            union {
+                struct {
+                    uint8_t unused : 4, c : 1, h : 1, n : 1, z : 1;
+                } f;
+                uint8_t flags;
+            };
             uint8_t a;
         };
         uint16_t af;
     };
+    struct LazyFlags lazy;
     REGISTER_UNION(b, c);
     REGISTER_UNION(d, e);
     REGISTER_UNION(h, l);
@@ -36,15 +86,53 @@ typedef struct CPU {
     uint16_t pc;
     Memory memory;
     PPU ppu;
+    Timer timer;
+    Interrupts interrupts;
     Scheduler sched;
+    BlockCache block_cache;
+    Dynarec dynarec;
+    enum ExecMode exec_mode;
     uint64_t t_cycles;
+    //  Instructions executed, not counting skipped idle loop iterations.
+    uint64_t instructions;
+    Profile profile;
     bool halted;
-    bool ime;
+    enum CPUFault fault;
+    //  Address of the instruction that faulted.
+    uint16_t fault_pc;
+    bool idle_skip;
+    struct IdleLoop idle_loop;
+    uint64_t idle_skipped_cycles;
 } CPU;
 
 CPU *createCPU(void);
 void destroyCPU(CPU *);
+//  Returns the CPU to its power-on state while keeping the block cache and
+//  dynarec allocations, the exec mode, idle skipping and the render thread
+//  setting, for reuse.
+void resetCPU(CPU *);
+
+void setExecMode(CPU *, enum ExecMode mode);
+//  Lets time jump ahead while the CPU busy-waits on IO registers.
+void setIdleSkip(CPU *, bool enable);
+//  Draws frames on a worker thread, they are then handed out one frame late.
+//  Takes effect at the end of the current frame, see renderer.h.
+void setRenderThread(CPU *, bool enable);
 
+//  Runs until the next scheduled event is due and then runs it.
 void updateCPU(CPU *);
 
+//  Frame sink for the finished 160x144 XRGB8888 image.
+void setFrameCallback(CPU *, FrameCallback callback, void *user);
+//  Runs until the next frame was emitted, or for a frame's worth of cycles
+//  while the LCD is off. Returns early if the CPU faults.
+void runUntilFrame(CPU *);
+void runCycles(CPU *, uint64_t cycles);
+//  Takes a mask of JoypadButtons.
+void setJoypad(CPU *, uint8_t buttons);
+
+//  Folds pending lazy flags into f. Every public run function above calls
+//  it before returning, so af is exact between runs.
+void syncFlags(CPU *);
+
 void tickM(CPU *cpu, size_t cycles);
\ No newline at end of file
@@ -0,0 +1,500 @@
+#include "dynarec.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <backend/cpu.h>
+
+//  Upper bound of emitted bytes per micro-op plus the prologue/epilogue.
+#define MAX_OP_BYTES 128
+#define MAX_BLOCK_BYTES (BLOCK_MAX_OPS * MAX_OP_BYTES + 64)
+#define MAX_EXITS (BLOCK_MAX_OPS * 4)
+
+bool isBlockCompilable(const BlockCache *cache,
+                       const struct CachedBlock *block) {
+    const struct MicroOp *last = &block->ops[block->op_count - 1];
+    uint16_t end = last->pc + last->length - 1;
+    for (uint32_t page = block->pc >> 8; page <= (uint32_t)(end >> 8); ++page)
+        if (cache->invalidations[page] >= DYNAREC_SMC_THRESHOLD)
+            return false;
+    return true;
+}
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+
+struct Emitter {
+    uint8_t *code;
+    size_t size;
+    //  Offsets of rel32 fields that must point at the block epilogue.
+    size_t exits[MAX_EXITS];
+    size_t exit_count;
+    //  T-cycles and instructions of native ops not added to the CPU yet.
+    uint32_t cycles;
+    uint32_t instructions;
+    //  Set once lazy.op is known to be LAZY_NONE, so f holds the flags.
+    bool flags_exact;
+    //  Set while pc still points before the native ops emitted last.
+    bool pc_stale;
+};
+
+//  Offsets of B, C, D, E, H, L and A by their index in the opcode. Index 6
+//  is (HL), which is left to the handlers.
+static const size_t R8_OFFSETS[8] = {
+    offsetof(CPU, b), offsetof(CPU, c), offsetof(CPU, d), offsetof(CPU, e),
+    offsetof(CPU, h), offsetof(CPU, l), 0,                offsetof(CPU, a),
+};
+
+static const size_t R16_OFFSETS[4] = {
+    offsetof(CPU, bc),
+    offsetof(CPU, de),
+    offsetof(CPU, hl),
+    offsetof(CPU, sp),
+};
+
+//  F for each AH after LAHF. x86 sets AF and CF like the SM83 sets H and C
+//  for additions, subtractions, INC and DEC, so only N is left to add.
+static uint8_t lahf_flags[256];
+
+static void emit8(struct Emitter *e, uint8_t val) { e->code[e->size++] = val; }
+
+static void emit16(struct Emitter *e, uint16_t val) {
+    memcpy(&e->code[e->size], &val, sizeof(val));
+    e->size += sizeof(val);
+}
+
+static void emit32(struct Emitter *e, uint32_t val) {
+    memcpy(&e->code[e->size], &val, sizeof(val));
+    e->size += sizeof(val);
+}
+
+static void emit64(struct Emitter *e, uint64_t val) {
+    memcpy(&e->code[e->size], &val, sizeof(val));
+    e->size += sizeof(val);
+}
+
+static void emitBytes(struct Emitter *e, const uint8_t *bytes, size_t n) {
+    memcpy(&e->code[e->size], bytes, n);
+    e->size += n;
+}
+
+//  Opcode bytes followed by a [rbx + offset] operand, reg is the ModRM reg
+//  field (a register or an opcode extension).
+static void emitMem(struct Emitter *e, const uint8_t *bytes, size_t n,
+                    uint8_t reg, size_t offset) {
+    emitBytes(e, bytes, n);
+    emit8(e, 0x83 | reg << 3);
+    emit32(e, offset);
+}
+
+//  jcc rel32 to the epilogue, cc is the second opcode byte (0x8X).
+static void emitExit(struct Emitter *e, uint8_t cc) {
+    emit8(e, 0x0F);
+    emit8(e, cc);
+    e->exits[e->exit_count++] = e->size;
+    emit32(e, 0);
+}
+
+//  jmp rel32 to the epilogue.
+static void emitJumpExit(struct Emitter *e) {
+    emit8(e, 0xE9);
+    e->exits[e->exit_count++] = e->size;
+    emit32(e, 0);
+}
+
+//  mov rdi, rbx; call func
+static void emitCall(struct Emitter *e, const void *func) {
+    emitBytes(e, (const uint8_t[]){0x48, 0x89, 0xDF}, 3);
+    int64_t rel = (intptr_t)func - (intptr_t)&e->code[e->size + 5];
+    if (rel >= INT32_MIN && rel <= INT32_MAX) {
+        emit8(e, 0xE8);
+        emit32(e, (int32_t)rel);
+    } else {
+        //  mov rax, func; call rax
+        emitBytes(e, (const uint8_t[]){0x48, 0xB8}, 2);
+        emit64(e, (uint64_t)(uintptr_t)func);
+        emitBytes(e, (const uint8_t[]){0xFF, 0xD0}, 2);
+    }
+}
+
+//  mov word [rbx + pc], pc
+static void emitSetPC(struct Emitter *e, uint16_t pc) {
+    emitMem(e, (const uint8_t[]){0x66, 0xC7}, 2, 0, offsetof(CPU, pc));
+    emit16(e, pc);
+}
+
+//  Adds the batched cycles and instructions plus the given ones to the CPU.
+static void emitFlush(struct Emitter *e, uint32_t cycles,
+                      uint32_t instructions) {
+    cycles += e->cycles;
+    instructions += e->instructions;
+    //  add qword [rbx + t_cycles], cycles
+    if (cycles) {
+        emitMem(e, (const uint8_t[]){0x48, 0x81}, 2, 0,
+                offsetof(CPU, t_cycles));
+        emit32(e, cycles);
+    }
+    //  add qword [rbx + instructions], instructions
+    if (instructions) {
+        emitMem(e, (const uint8_t[]){0x48, 0x81}, 2, 0,
+                offsetof(CPU, instructions));
+        emit32(e, instructions);
+    }
+}
+
+//  Folds pending lazy flags into f, unless already done in this block.
+static void emitSyncFlags(struct Emitter *e) {
+    if (e->flags_exact)
+        return;
+    //  cmp byte [rbx + lazy.op], LAZY_NONE; je skip; call syncFlags
+    emitMem(e, (const uint8_t[]){0x80}, 1, 7, offsetof(CPU, lazy.op));
+    emit8(e, LAZY_NONE);
+    emit8(e, 0x74);
+    size_t skip = e->size;
+    emit8(e, 0);
+    emitCall(e, (const void *)syncFlags);
+    e->code[skip] = e->size - (skip + 1);
+    e->flags_exact = true;
+}
+
+//  Turns the x86 flags into F in cl: lahf; movzx ecx, ah;
+//  movzx ecx, byte [r14 + rcx]
+static void emitFlagsToCL(struct Emitter *e) {
+    emitBytes(e, (const uint8_t[]){0x9F, 0x0F, 0xB6, 0xCC, 0x41, 0x0F, 0xB6,
+                                   0x0C, 0x0E},
+              9);
+}
+
+//  mov [rbx + flags], cl, the lazy state is cleared if it may be set.
+static void emitStoreFlags(struct Emitter *e) {
+    emitMem(e, (const uint8_t[]){0x88}, 1, 1, offsetof(CPU, flags));
+    if (!e->flags_exact) {
+        //  mov byte [rbx + lazy.op], LAZY_NONE
+        emitMem(e, (const uint8_t[]){0xC6}, 1, 0, offsetof(CPU, lazy.op));
+        emit8(e, LAZY_NONE);
+        e->flags_exact = true;
+    }
+}
+
+//  ADD, ADC, SUB, SBC, AND, XOR, OR and CP of A with register src, or with
+//  imm if src is 6.
+static void emitALU(struct Emitter *e, uint8_t alu, uint8_t src, uint8_t imm) {
+    static const uint8_t X86_OPS[8] = {0x02, 0x12, 0x2A, 0x1A,
+                                       0x22, 0x32, 0x0A, 0x3A};
+    //  ADC and SBC take C from f into CF: mov cl, [rbx + flags]; shr cl, 5
+    if (alu == 1 || alu == 3) {
+        emitSyncFlags(e);
+        emitMem(e, (const uint8_t[]){0x8A}, 1, 1, offsetof(CPU, flags));
+        emitBytes(e, (const uint8_t[]){0xC0, 0xE9, 0x05}, 3);
+    }
+    //  mov al, [rbx + a]; op al, src
+    emitMem(e, (const uint8_t[]){0x8A}, 1, 0, offsetof(CPU, a));
+    if (src == 6) {
+        emit8(e, X86_OPS[alu] + 2);
+        emit8(e, imm);
+    } else {
+        emitMem(e, &X86_OPS[alu], 1, 0, R8_OFFSETS[src]);
+    }
+    emitFlagsToCL(e);
+    switch (alu) {
+    case 2:
+    case 3:
+    case 7: //  or cl, N
+        emitBytes(e, (const uint8_t[]){0x80, 0xC9, 0x40}, 3);
+        break;
+    case 4: //  and cl, Z; or cl, H
+        emitBytes(e, (const uint8_t[]){0x80, 0xE1, 0x80, 0x80, 0xC9, 0x20}, 6);
+        break;
+    case 5:
+    case 6: //  and cl, Z
+        emitBytes(e, (const uint8_t[]){0x80, 0xE1, 0x80}, 3);
+        break;
+    }
+    //  mov [rbx + a], al
+    if (alu != 7)
+        emitMem(e, (const uint8_t[]){0x88}, 1, 0, offsetof(CPU, a));
+    emitStoreFlags(e);
+}
+
+//  INC or DEC of register r, which keeps C.
+static void emitIncDec(struct Emitter *e, uint8_t r, bool dec) {
+    emitSyncFlags(e);
+    //  inc/dec byte [rbx + r]
+    emitMem(e, (const uint8_t[]){0xFE}, 1, dec, R8_OFFSETS[r]);
+    emitFlagsToCL(e);
+    //  and cl, Z | H; or cl, N
+    emitBytes(e, (const uint8_t[]){0x80, 0xE1, 0xA0}, 3);
+    if (dec)
+        emitBytes(e, (const uint8_t[]){0x80, 0xC9, 0x40}, 3);
+    //  mov dl, [rbx + flags]; and dl, C; or cl, dl
+    emitMem(e, (const uint8_t[]){0x8A}, 1, 2, offsetof(CPU, flags));
+    emitBytes(e, (const uint8_t[]){0x80, 0xE2, 0x10, 0x08, 0xD1}, 5);
+    emitStoreFlags(e);
+}
+
+//  JR and JP, always the last op of a block.
+static void emitBranch(struct Emitter *e, const struct MicroOp *op,
+                       uint16_t target, bool conditional) {
+    uint16_t next_pc = op->pc + op->length;
+    if (conditional) {
+        //  NZ, Z, NC or C, test leaves ZF set if the flag is clear.
+        uint8_t cc = op->opcode >> 3 & 3;
+        emitSyncFlags(e);
+        //  test byte [rbx + flags], Z or C; jz/jnz taken
+        emitMem(e, (const uint8_t[]){0xF6}, 1, 0, offsetof(CPU, flags));
+        emit8(e, cc < 2 ? 0x80 : 0x10);
+        emit8(e, cc & 1 ? 0x75 : 0x74);
+        size_t taken = e->size;
+        emit8(e, 0);
+        //  Not taken is an M-cycle shorter.
+        emitSetPC(e, next_pc);
+        emitFlush(e, (op->cycles - 1) * 4, 1);
+        emitJumpExit(e);
+        e->code[taken] = e->size - (taken + 1);
+    }
+    emitSetPC(e, target);
+    emitFlush(e, op->cycles * 4, 1);
+    e->cycles = e->instructions = 0;
+    e->pc_stale = false;
+}
+
+//  Emits op without its handler if it only touches registers, returns false
+//  if the handler has to run it.
+static bool emitNativeOp(struct Emitter *e, const struct MicroOp *op) {
+    uint8_t opcode = op->opcode;
+    uint8_t hi = opcode >> 3 & 7, lo = opcode & 7;
+    uint16_t next_pc = op->pc + op->length;
+    switch (opcode) {
+    case 0x00: //  NOP
+        break;
+    case 0x01:
+    case 0x11:
+    case 0x21:
+    case 0x31: //  LD rr, u16: mov word [rbx + rr], u16
+        emitMem(e, (const uint8_t[]){0x66, 0xC7}, 2, 0,
+                R16_OFFSETS[opcode >> 4]);
+        emit16(e, op->operand);
+        break;
+    case 0x03:
+    case 0x13:
+    case 0x23:
+    case 0x33: //  INC rr: inc word [rbx + rr]
+    case 0x0B:
+    case 0x1B:
+    case 0x2B:
+    case 0x3B: //  DEC rr: dec word [rbx + rr]
+        emitMem(e, (const uint8_t[]){0x66, 0xFF}, 2, opcode >> 3 & 1,
+                R16_OFFSETS[opcode >> 4]);
+        break;
+    case 0x04:
+    case 0x0C:
+    case 0x14:
+    case 0x1C:
+    case 0x24:
+    case 0x2C:
+    case 0x3C: //  INC r
+    case 0x05:
+    case 0x0D:
+    case 0x15:
+    case 0x1D:
+    case 0x25:
+    case 0x2D:
+    case 0x3D: //  DEC r
+        emitIncDec(e, hi, opcode & 1);
+        break;
+    case 0x06:
+    case 0x0E:
+    case 0x16:
+    case 0x1E:
+    case 0x26:
+    case 0x2E:
+    case 0x3E: //  LD r, u8: mov byte [rbx + r], u8
+        emitMem(e, (const uint8_t[]){0xC6}, 1, 0, R8_OFFSETS[hi]);
+        emit8(e, op->operand);
+        break;
+    case 0x40 ... 0x7F: //  LD r, r: mov al, [rbx + src]; mov [rbx + dst], al
+        if (hi == 6 || lo == 6)
+            return false;
+        if (hi != lo) {
+            emitMem(e, (const uint8_t[]){0x8A}, 1, 0, R8_OFFSETS[lo]);
+            emitMem(e, (const uint8_t[]){0x88}, 1, 0, R8_OFFSETS[hi]);
+        }
+        break;
+    case 0x80 ... 0xBF: //  ALU A, r
+        if (lo == 6)
+            return false;
+        emitALU(e, hi, lo, 0);
+        break;
+    case 0xC6:
+    case 0xCE:
+    case 0xD6:
+    case 0xDE:
+    case 0xE6:
+    case 0xEE:
+    case 0xF6:
+    case 0xFE: //  ALU A, u8
+        emitALU(e, hi, 6, op->operand);
+        break;
+    case 0x18: //  JR i8
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38: //  JR cc, i8
+        emitBranch(e, op, next_pc + (int8_t)op->operand, opcode != 0x18);
+        return true;
+    case 0xC3: //  JP u16
+    case 0xC2:
+    case 0xCA:
+    case 0xD2:
+    case 0xDA: //  JP cc, u16
+        emitBranch(e, op, op->operand, opcode != 0xC3);
+        return true;
+    default:
+        return false;
+    }
+    e->cycles += op->cycles * 4;
+    ++e->instructions;
+    e->pc_stale = true;
+    return true;
+}
+
+//  Runs op through its handler with the cycles batched so far added first.
+//  Handlers may write memory, so unless op ends the block the exit checks
+//  follow: the block was invalidated, the deadline changed or an interrupt
+//  became pending.
+static void emitHandlerOp(struct Emitter *e, const struct MicroOp *op,
+                          bool last) {
+    emitFlush(e, op->prefix * 4, 1);
+    e->cycles = e->instructions = 0;
+    e->flags_exact = false;
+    e->pc_stale = false;
+    emitSetPC(e, op->pc + op->prefix);
+    emitCall(e, (const void *)op->func);
+    if (last)
+        return;
+    //  cmp [rbx + generation], r12d; jne exit
+    emitMem(e, (const uint8_t[]){0x44, 0x39}, 2, 4,
+            offsetof(CPU, block_cache.generation));
+    emitExit(e, 0x85);
+    //  cmp [rbx + next_deadline], r13; jne exit
+    emitMem(e, (const uint8_t[]){0x4C, 0x39}, 2, 5,
+            offsetof(CPU, sched.next_deadline));
+    emitExit(e, 0x85);
+    //  cmp byte [rbx + interrupts.pending], 0; jne exit
+    emitMem(e, (const uint8_t[]){0x80}, 1, 7, offsetof(CPU, interrupts.pending));
+    emit8(e, 0);
+    emitExit(e, 0x85);
+}
+
+bool initDynarec(Dynarec *dynarec) {
+    if (dynarec->arena)
+        return true;
+    //  LAHF is missing in long mode on some of the first x86-64 CPUs.
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(ecx & 1)) {
+        fprintf(stderr, "dynarec needs LAHF in 64-bit mode!\n");
+        return false;
+    }
+    for (size_t ah = 0; ah < 256; ++ah)
+        lahf_flags[ah] = (ah >> 6 & 1) << 7 | (ah >> 4 & 1) << 5 |
+                         (ah & 1) << 4;
+    //  Ask for an arena close to the handlers so calls fit in a rel32. It is
+    //  never writable and executable at the same time, compileBlock flips
+    //  the pages it emits to.
+    uintptr_t hint = ((uintptr_t)tickM + MB(256)) & ~(uintptr_t)(MB(2) - 1);
+    void *arena = mmap((void *)hint, DYNAREC_ARENA_SIZE,
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+    if (arena == MAP_FAILED) {
+        fprintf(stderr, "could not map dynarec arena!\n");
+        return false;
+    }
+    dynarec->arena = arena;
+    dynarec->used = 0;
+    return true;
+}
+
+void destroyDynarec(Dynarec *dynarec) {
+    if (dynarec->arena)
+        munmap(dynarec->arena, DYNAREC_ARENA_SIZE);
+    dynarec->arena = NULL;
+}
+
+/*
+    Native code keeps no guest state in host registers, so the CPU is
+    exact whenever a handler runs or the block exits. Cycles and
+    instructions of native ops are added once before each handler call and
+    at the end. runCompiledBlock only enters a block whose worst-case cycles
+    fit before the deadline, so it is not checked between native ops.
+    rbx holds the CPU, r12d the generation, r13 the deadline on entry and
+    r14 lahf_flags.
+*/
+NativeBlock compileBlock(Dynarec *dynarec, BlockCache *cache,
+                         struct CachedBlock *block) {
+    if (DYNAREC_ARENA_SIZE - dynarec->used < MAX_BLOCK_BYTES) {
+        //  Only called between blocks, so no native code is running.
+        for (size_t pc = 0; pc <= UINT16_MAX; ++pc)
+            if (cache->blocks[pc])
+                cache->blocks[pc]->native = NULL;
+        dynarec->used = 0;
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t begin = dynarec->used & ~(page_size - 1);
+    size_t end = (dynarec->used + MAX_BLOCK_BYTES + page_size - 1) &
+                 ~(page_size - 1);
+    if (end > DYNAREC_ARENA_SIZE)
+        end = DYNAREC_ARENA_SIZE;
+    if (mprotect(dynarec->arena + begin, end - begin, PROT_READ | PROT_WRITE))
+        PANIC;
+    struct Emitter e = {.code = dynarec->arena + dynarec->used};
+    //  push rbx; push r12; push r13; push r14; sub rsp, 8; mov rbx, rdi
+    emitBytes(&e, (const uint8_t[]){0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,
+                                    0x48, 0x83, 0xEC, 0x08, 0x48, 0x89, 0xFB},
+              14);
+    //  mov r12d, [rbx + generation]; mov r13, [rbx + next_deadline]
+    emitMem(&e, (const uint8_t[]){0x44, 0x8B}, 2, 4,
+            offsetof(CPU, block_cache.generation));
+    emitMem(&e, (const uint8_t[]){0x4C, 0x8B}, 2, 5,
+            offsetof(CPU, sched.next_deadline));
+    //  mov r14, lahf_flags
+    emitBytes(&e, (const uint8_t[]){0x49, 0xBE}, 2);
+    emit64(&e, (uint64_t)(uintptr_t)lahf_flags);
+    for (uint8_t i = 0; i < block->op_count; ++i) {
+        const struct MicroOp *op = &block->ops[i];
+        if (!emitNativeOp(&e, op))
+            emitHandlerOp(&e, op, i == block->op_count - 1);
+    }
+    const struct MicroOp *last = &block->ops[block->op_count - 1];
+    if (e.pc_stale)
+        emitSetPC(&e, last->pc + last->length);
+    emitFlush(&e, 0, 0);
+    for (size_t i = 0; i < e.exit_count; ++i) {
+        int32_t rel = e.size - (e.exits[i] + 4);
+        memcpy(&e.code[e.exits[i]], &rel, sizeof(rel));
+    }
+    //  add rsp, 8; pop r14; pop r13; pop r12; pop rbx; ret
+    emitBytes(&e, (const uint8_t[]){0x48, 0x83, 0xC4, 0x08, 0x41, 0x5E, 0x41,
+                                    0x5D, 0x41, 0x5C, 0x5B, 0xC3},
+              12);
+    if (mprotect(dynarec->arena + begin, end - begin, PROT_READ | PROT_EXEC))
+        PANIC;
+    NativeBlock native = (NativeBlock)(void *)e.code;
+    dynarec->used += (e.size + 15) & ~(size_t)15;
+    return native;
+}
+
+#else
+
+bool initDynarec(Dynarec *dynarec) {
+    fprintf(stderr, "dynarec is only available on x86-64 hosts!\n");
+    return false;
+}
+
+void destroyDynarec(Dynarec *dynarec) {}
+
+NativeBlock compileBlock(Dynarec *dynarec, BlockCache *cache,
+                         struct CachedBlock *block) {
+    return NULL;
+}
+
+#endif
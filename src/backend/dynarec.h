@@ -0,0 +1,31 @@
+/*
+    Dynamic recompiler that turns cached blocks into x86-64 code. Register
+    loads, ALU ops, INC/DEC and JR/JP are translated to native instructions
+    working on the CPU struct, with exact flags. Everything else, memory
+    accesses included, becomes a direct call to its opcode handler followed
+    by the exit checks (invalidation, deadline change, pending interrupt).
+    Cycles are added once per block and around handler calls, the deadline
+    is checked once before entering a block. HALT always ends a block so it
+    needs no check of its own.
+    On other hosts initDynarec fails and the cached interpreter is used.
+*/
+#pragma once
+#include <utility.h>
+#include "blockcache.h"
+
+#define DYNAREC_ARENA_SIZE MB(8)
+//  Pages invalidated this many times are treated as self-modifying code and
+//  are only ever interpreted.
+#define DYNAREC_SMC_THRESHOLD 2
+
+typedef struct {
+    uint8_t *arena;
+    size_t used;
+} Dynarec;
+
+bool initDynarec(Dynarec *dynarec);
+void destroyDynarec(Dynarec *dynarec);
+
+bool isBlockCompilable(const BlockCache *cache, const struct CachedBlock *block);
+NativeBlock compileBlock(Dynarec *dynarec, BlockCache *cache,
+                         struct CachedBlock *block);
@@ -3,17 +3,11 @@
 typedef struct Scheduler Scheduler;
 typedef void (*EventFunc)(Scheduler *);
 
-void eventDI(Scheduler *);
-void eventEI(Scheduler *);
-
 void eventTimerInterrupt(Scheduler *);
-void eventSTATInterrupt(Scheduler *);
-void eventEvaluateInterrupts(Scheduler *);
+void eventPPUMode(Scheduler *);
 
 typedef enum {
-    eDI = 0,
-    eEI,
-    eTIMER_INTERRUPT,
-    eEVALUATE_INTERRUPTS,
+    eTIMER_INTERRUPT = 0,
+    ePPU_MODE,
     eCOUNT
 } EventEnum;
\ No newline at end of file
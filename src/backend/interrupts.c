@@ -0,0 +1,64 @@
+#include "interrupts.h"
+#include <backend/cpu.h>
+
+#define VECTOR_BASE 0x40
+
+static void updatePending(Interrupts *irq) {
+    irq->pending = (irq->ime ? wakingInterrupts(irq) : 0) | irq->ei_delay;
+}
+
+void requestInterrupt(CPU *cpu, enum Interrupt interrupt) {
+    cpu->interrupts.r_if |= BIT(interrupt);
+    updatePending(&cpu->interrupts);
+}
+
+//  The unused upper bits read as set.
+uint8_t readIF(const CPU *cpu) { return 0xE0 | cpu->interrupts.r_if; }
+
+void writeIF(CPU *cpu, uint8_t val) {
+    cpu->interrupts.r_if = val & INTERRUPT_MASK;
+    updatePending(&cpu->interrupts);
+}
+
+void writeIE(CPU *cpu, uint8_t val) {
+    cpu->interrupts.r_ie = val;
+    updatePending(&cpu->interrupts);
+}
+
+void enableInterrupts(CPU *cpu, bool delayed) {
+    Interrupts *irq = &cpu->interrupts;
+    if (!delayed) {
+        irq->ime = true;
+        irq->ei_delay = 0;
+    } else if (!irq->ime && !irq->ei_delay) {
+        //  The boundary right after EI only counts down, the next one sets
+        //  ime.
+        irq->ei_delay = 2;
+    }
+    updatePending(irq);
+}
+
+void disableInterrupts(CPU *cpu) {
+    cpu->interrupts.ime = false;
+    cpu->interrupts.ei_delay = 0;
+    updatePending(&cpu->interrupts);
+}
+
+void serviceInterrupts(CPU *cpu) {
+    Interrupts *irq = &cpu->interrupts;
+    if (irq->ei_delay && --irq->ei_delay == 0)
+        irq->ime = true;
+    uint8_t requests = wakingInterrupts(irq);
+    if (irq->ime && requests) {
+        unsigned bit = __builtin_ctz(requests);
+        irq->r_if &= ~BIT(bit);
+        irq->ime = false;
+        //  Two wait states, the pushes and the jump, 5 M-cycles in all.
+        tickM(cpu, 2);
+        memWrite(&cpu->memory, --cpu->sp, cpu->pc >> 8);
+        memWrite(&cpu->memory, --cpu->sp, cpu->pc);
+        cpu->pc = VECTOR_BASE + bit * 8;
+        tickM(cpu, 3);
+    }
+    updatePending(irq);
+}
@@ -0,0 +1,48 @@
+/*
+    Interrupt controller. IF and IE are kept together with a cached mask of
+    what needs attention at the next instruction boundary, so the CPU tests a
+    single byte per instruction and only calls in here when it is set.
+    Requests are dispatched by priority, the lowest IF bit first.
+*/
+#pragma once
+#include <utility.h>
+
+typedef struct CPU CPU;
+
+//  IF/IE bit of each source, also its priority.
+enum Interrupt {
+    INTERRUPT_VBLANK = 0,
+    INTERRUPT_STAT,
+    INTERRUPT_TIMER,
+    INTERRUPT_SERIAL,
+    INTERRUPT_JOYPAD,
+};
+
+#define INTERRUPT_MASK 0x1F
+
+typedef struct {
+    uint8_t r_if, r_ie;
+    bool ime;
+    //  Instruction boundaries left until a preceding EI sets ime.
+    uint8_t ei_delay;
+    //  Non-zero while an enabled request can be taken or an EI is pending.
+    uint8_t pending;
+} Interrupts;
+
+void requestInterrupt(CPU *cpu, enum Interrupt interrupt);
+uint8_t readIF(const CPU *cpu);
+void writeIF(CPU *cpu, uint8_t val);
+void writeIE(CPU *cpu, uint8_t val);
+
+//  EI sets ime after the instruction following it, RETI right away.
+void enableInterrupts(CPU *cpu, bool delayed);
+void disableInterrupts(CPU *cpu);
+
+//  Called at an instruction boundary while pending is set. Advances the EI
+//  delay and dispatches the highest priority request if ime allows it.
+void serviceInterrupts(CPU *cpu);
+
+//  Requests that end HALT, whether or not ime is set.
+static inline uint8_t wakingInterrupts(const Interrupts *irq) {
+    return irq->r_if & irq->r_ie & INTERRUPT_MASK;
+}
@@ -3,60 +3,124 @@
 #include <string.h>
 #include <backend/events.h>
 #include <backend/cpu.h>
+#include <backend/renderer.h>
 
+#define IO_P1 0x00
 #define IO_DIV 0x04
 #define IO_TIMA 0x05
 #define IO_TMA 0x06
 #define IO_TAC 0x07
 #define IO_IF 0x0F
-#define IO_LCDC 0x40
-#define IO_STAT 0x41
-#define IO_SCY 0x42
-#define IO_SCX 0x43
-#define IO_LY 0x44
-#define IO_LYC 0x45
-#define IO_BGP 0x47
-#define IO_OBP0 0x48
-#define IO_OBP1 0x49
-#define IO_WY 0x4A
-#define IO_WX 0x4B
 
-static bool isSlowMemAccess(uint16_t adr) {
-    switch (adr) {
-    case VRAM_BEG ... VRAM_END:
-    case ERAM_BEG ... ERAM_END:
-    case OAM_BEG ... OAM_END:
-    case IO_BEG ... IO_END:
-    case IE:
-    case 0x100:
+//  Brings the PPU up to date before any state it shares with the CPU is used.
+static void syncPPU(Memory *mem) {
+    CPU *cpu = mem->sched->reference;
+    ppuSync(&cpu->ppu, mem, cpu->t_cycles);
+}
+
+//  Also ends the scanline renderer's use of the current line, which assumes
+//  nothing it reads changes during mode 3.
+static void syncPPUForWrite(Memory *mem) {
+    CPU *cpu = mem->sched->reference;
+    ppuSync(&cpu->ppu, mem, cpu->t_cycles);
+    ppuFallBackToFIFO(&cpu->ppu, mem);
+}
+
+//  Writes that change the picture are replayed by the render worker, if one
+//  draws the frames. Called once the PPU is synced.
+static void logRenderWrite(Memory *mem, uint16_t adr, uint8_t val) {
+    PPU *ppu = &mem->sched->reference->ppu;
+    if (ppu->worker)
+        recordRenderWrite(ppu->worker, ppu->cycles, adr, val);
+}
+
+static bool isPPUSyncedIO(uint16_t real_adr) {
+    switch (real_adr) {
+    case IO_LCDC ... IO_WX:
+    case IO_IF:
         return true;
     }
     return false;
 }
 
-static void writeRom(Memory *mem, uint16_t adr, uint8_t val) {}
+//  Registers read by the scanline renderer.
+static bool isPPURenderIO(uint16_t real_adr) {
+    switch (real_adr) {
+    case IO_LCDC:
+    case IO_SCY:
+    case IO_SCX:
+    case IO_BGP ... IO_WX:
+        return true;
+    }
+    return false;
+}
+
+static void mapPages(Memory *mem, uint16_t beg, uint16_t end, uint8_t *read,
+                     uint8_t *write) {
+    for (uint16_t page = beg >> 8; page <= end >> 8; ++page) {
+        uint16_t offset = (page - (beg >> 8)) << 8;
+        uint8_t *prev = mem->read_map[page];
+        mem->read_map[page] = read ? read + offset : NULL;
+        mem->write_map[page] = write ? write + offset : NULL;
+        if (mem->code_pages[page] && mem->read_map[page] != prev)
+            remapBlockPage(&mem->sched->reference->block_cache,
+                           mem->code_pages, page);
+    }
+}
+
+//  Points the ROM and ERAM pages at the currently selected banks.
+static void mapCartridge(Memory *mem) {
+    Cartridge *cart = &mem->cart;
+    uint16_t beg = mem->boot_rom_mapped ? 0x0200 : 0x0000;
+    mapPages(mem, beg, 0x3FFF, cart->rom + cartROMOffset(cart, beg), NULL);
+    mapPages(mem, 0x4000, 0x7FFF, cart->rom + cartROMOffset(cart, 0x4000),
+             NULL);
+    uint8_t *ram = cartRAMBank(cart);
+    //  Writes to saved RAM go through cartWriteRAM to be tracked.
+    mapPages(mem, ERAM_BEG, ERAM_END, ram, cart->save ? NULL : ram);
+    if (mem->boot_rom_mapped) {
+        //  The boot ROM overlays the first page until 0x100 is fetched.
+        mapPages(mem, 0x0000, 0x00FF, mem->boot_rom, NULL);
+        mapPages(mem, 0x0100, 0x01FF, NULL, NULL);
+    }
+}
+
+static void writeRom(Memory *mem, uint16_t adr, uint8_t val) {
+    if (cartWriteMBC(&mem->cart, adr, val))
+        mapCartridge(mem);
+}
 
 static uint8_t readVRAM(Memory *mem, uint16_t adr) {
+    syncPPU(mem);
     return mem->mmap.slowmem.vram[adr - VRAM_BEG];
 }
 
 static void writeVRAM(Memory *mem, uint16_t adr, uint8_t val) {
+    syncPPUForWrite(mem);
+    logRenderWrite(mem, adr, val);
     mem->mmap.slowmem.vram[adr - VRAM_BEG] = val;
+    markTileDirty(&mem->sched->reference->ppu.tiles, adr - VRAM_BEG);
 }
 
 static uint8_t readIO(Memory *mem, uint16_t adr) {
     uint16_t real_adr = adr - IO_BEG;
     if (real_adr > IO_END)
         PANIC;
+    if (isPPUSyncedIO(real_adr))
+        syncPPU(mem);
     switch (real_adr) {
-    case IO_DIV:
-        return mem->mmap.slowmem.io.div;
-    case IO_TIMA:
-        return mem->mmap.slowmem.io.tima;
-    case IO_TMA:
-        return mem->mmap.slowmem.io.tma;
-    case IO_TAC:
-        return mem->mmap.slowmem.io.tac;
+    case IO_P1: {
+        //  Selection bits are active low, so are the reported buttons.
+        uint8_t select = mem->mmap.slowmem.io.data[IO_P1];
+        uint8_t pressed = 0;
+        if (!(select & BIT(4)))
+            pressed |= mem->joypad >> 4;
+        if (!(select & BIT(5)))
+            pressed |= mem->joypad & 0x0F;
+        return 0xC0 | (select & 0x30) | (~pressed & 0x0F);
+    }
+    case IO_DIV ... IO_TAC:
+        return timerRead(mem->sched->reference, adr);
     case IO_LCDC:
         return mem->sched->reference->ppu.lcdc;
     case IO_STAT:
@@ -80,7 +144,7 @@ static uint8_t readIO(Memory *mem, uint16_t adr) {
     case IO_WX:
         return mem->sched->reference->ppu.wx;
     case IO_IF:
-        return mem->mmap.slowmem.io.r_if;
+        return readIF(mem->sched->reference);
     default:
         return mem->mmap.slowmem.io.data[adr - IO_BEG];
     }
@@ -90,38 +154,20 @@ static void writeIO(Memory *mem, uint16_t adr, uint8_t val) {
     uint16_t real_adr = adr - IO_BEG;
     if (real_adr > IO_END)
         PANIC;
-    switch (real_adr) {
-    case IO_TIMA: {
-        mem->mmap.slowmem.io.tima = val;
-        if (mem->mmap.slowmem.io.tac & BIT(2)) {
-            switch (mem->mmap.slowmem.io.tac & 0b11) {
-            case 0:
-                scheduleEvent(mem->sched, (0xFF - val) * 1024,
-                              eTIMER_INTERRUPT);
-                break;
-            case 1:
-                scheduleEvent(mem->sched, (0xFF - val) * 16, eTIMER_INTERRUPT);
-                break;
-            case 2:
-                scheduleEvent(mem->sched, (0xFF - val) * 64, eTIMER_INTERRUPT);
-                break;
-            case 3:
-                scheduleEvent(mem->sched, (0xFF - val) * 256, eTIMER_INTERRUPT);
-                break;
-            }
-        }
-        break;
-    }
-    case IO_TMA: {
-        mem->mmap.slowmem.io.tma = val;
-        break;
+    if (isPPURenderIO(real_adr)) {
+        syncPPUForWrite(mem);
+        logRenderWrite(mem, adr, val);
+    } else if (isPPUSyncedIO(real_adr)) {
+        syncPPU(mem);
     }
-    case IO_TAC: {
-        mem->mmap.slowmem.io.tac = val;
+    switch (real_adr) {
+    case IO_DIV ... IO_TAC:
+        timerWrite(mem->sched->reference, adr, val);
         break;
-    }
     case IO_LCDC: {
-        mem->sched->reference->ppu.lcdc = val;
+        writePPURegister(&mem->sched->reference->ppu, real_adr, val);
+        if (val & BIT(7))
+            scheduleEvent(mem->sched, 0, ePPU_MODE);
         break;
     }
     case IO_STAT: {
@@ -129,12 +175,10 @@ static void writeIO(Memory *mem, uint16_t adr, uint8_t val) {
             (val & (~0b11)) | (mem->sched->reference->ppu.stat & 0b11);
         break;
     }
-    case IO_SCY: {
-        mem->sched->reference->ppu.scy = val;
-        break;
-    }
-    case IO_SCX: {
-        mem->sched->reference->ppu.scx = val;
+    case IO_SCY:
+    case IO_SCX:
+    case IO_BGP ... IO_WX: {
+        writePPURegister(&mem->sched->reference->ppu, real_adr, val);
         break;
     }
     case IO_LY: {
@@ -145,29 +189,8 @@ static void writeIO(Memory *mem, uint16_t adr, uint8_t val) {
         mem->sched->reference->ppu.lyc = val;
         break;
     }
-    case IO_BGP: {
-        mem->sched->reference->ppu.bgp = val;
-        break;
-    }
-    case IO_OBP0: {
-        mem->sched->reference->ppu.obp0 = val;
-        break;
-    }
-    case IO_OBP1: {
-        mem->sched->reference->ppu.obp1 = val;
-        break;
-    }
-    case IO_WY: {
-        mem->sched->reference->ppu.wy = val;
-        break;
-    }
-    case IO_WX: {
-        mem->sched->reference->ppu.wx = val;
-        break;
-    }
     case IO_IF: {
-        mem->mmap.slowmem.io.r_if = val;
-        eventEvaluateInterrupts(mem->sched);
+        writeIF(mem->sched->reference, val);
         break;
     }
     default:
@@ -176,106 +199,160 @@ static void writeIO(Memory *mem, uint16_t adr, uint8_t val) {
 }
 
 static uint8_t readOAM(Memory *mem, uint16_t adr) {
+    syncPPU(mem);
     return mem->mmap.slowmem.oam[adr - OAM_BEG];
 }
 
 static void writeOAM(Memory *mem, uint16_t adr, uint8_t val) {
+    syncPPU(mem);
+    logRenderWrite(mem, adr, val);
     mem->mmap.slowmem.oam[adr - OAM_BEG] = val;
 }
 
-static uint8_t readERAM(Memory *mem, uint16_t adr) {
-    return mem->mmap.slowmem.eram[adr - ERAM_BEG];
-}
-
-static void writeERAM(Memory *mem, uint16_t adr, uint8_t val) {
-    mem->mmap.slowmem.eram[adr - ERAM_BEG] = val;
+uint8_t peekVRAM(const Memory *mem, uint16_t adr) {
+    return mem->mmap.slowmem.vram[adr - VRAM_BEG];
 }
 
-uint8_t memRead(Memory *mem, uint16_t adr) {
-    if (isSlowMemAccess(adr)) {
-        switch (adr) {
-        case VRAM_BEG ... VRAM_END:
-            return readVRAM(mem, adr);
-        case ERAM_BEG ... ERAM_END:
-            return readERAM(mem, adr);
-        case OAM_BEG ... OAM_END:
-            return readOAM(mem, adr);
-        case IO_BEG ... IO_END:
-            return readIO(mem, adr);
-        case IE:
-            return mem->mmap.slowmem.io.r_ie;
-        case 0x100:
+static uint8_t readSlowMem(Memory *mem, uint16_t adr) {
+    switch (adr) {
+    case 0x0000 ... 0x7FFF:
+        //  With a cartridge only page 1 ends up here, and only while the boot
+        //  ROM is mapped. Fetching 0x100 unmounts it.
+        if (!mem->cart.rom)
+            return 0xFF;
+        if (adr == 0x100)
             unmountBootROM(mem);
-            return mem->mmap.fastmem[0x100];
-        default:
-            PANIC;
-        }
-    } else
+        return mem->cart.rom[cartROMOffset(&mem->cart, adr)];
+    case ERAM_BEG ... ERAM_END:
+        return cartReadRAM(&mem->cart, adr);
+    case VRAM_BEG ... VRAM_END:
+        return readVRAM(mem, adr);
+    case OAM_BEG ... OAM_END:
+        return readOAM(mem, adr);
+    case IO_BEG ... IO_END:
+        return readIO(mem, adr);
+    case IE:
+        return mem->sched->reference->interrupts.r_ie;
+    case OAM_END + 1 ... IO_BEG - 1:
+    case IO_END + 1 ... IE - 1:
         return mem->mmap.fastmem[adr];
+    default:
+        PANIC;
+    }
     return 0;
 }
 
-void memWrite(Memory *mem, uint16_t adr, uint8_t val) {
-    if (isSlowMemAccess(adr)) {
-        switch (adr) {
-        case VRAM_BEG ... VRAM_END:
-            writeVRAM(mem, adr, val);
-            break;
-        case ERAM_BEG ... ERAM_END:
-            writeERAM(mem, adr, val);
-            break;
-        case OAM_BEG ... OAM_END:
-            writeOAM(mem, adr, val);
-            break;
-        case IO_BEG ... IO_END:
-            writeIO(mem, adr, val);
-            break;
-        case IE:
-            mem->mmap.slowmem.io.r_ie = val;
-            eventEvaluateInterrupts(mem->sched);
-            break;
-        case 0x100:
-            writeRom(mem, 0x100, val);
-            break;
-        default:
-            PANIC;
-        }
-    } else if (adr <= 0x7FFF)
+static void writeSlowMem(Memory *mem, uint16_t adr, uint8_t val) {
+    switch (adr) {
+    case 0x0000 ... 0x7FFF:
         writeRom(mem, adr, val);
-    else
+        break;
+    case VRAM_BEG ... VRAM_END:
+        writeVRAM(mem, adr, val);
+        break;
+    case ERAM_BEG ... ERAM_END:
+        cartWriteRAM(&mem->cart, adr, val);
+        break;
+    case OAM_BEG ... OAM_END:
+        writeOAM(mem, adr, val);
+        break;
+    case IO_BEG ... IO_END:
+        writeIO(mem, adr, val);
+        break;
+    case IE:
+        syncPPU(mem);
+        writeIE(mem->sched->reference, val);
+        break;
+    case OAM_END + 1 ... IO_BEG - 1:
+    case IO_END + 1 ... IE - 1:
         mem->mmap.fastmem[adr] = val;
-}
-
-void loadROM(Memory *mem, const char *path) {
-    if (mem->boot_rom_path[0] == '\0') {
-        fprintf(stderr, "no boot rom specified! Panicking!\n");
+        if (mem->code_pages[adr >> 8])
+            invalidateBlockPage(&mem->sched->reference->block_cache,
+                                mem->code_pages, adr >> 8);
+        break;
+    default:
         PANIC;
     }
-    FILE *file = fopen(path, "r");
-    if (!file) {
-        fprintf(stderr, "%s rom could not be found! Panicking!\n", path);
-        PANIC;
+}
+
+void initMemory(Memory *mem, Scheduler *sched) {
+    mem->sched = sched;
+    uint8_t *fastmem = mem->mmap.fastmem;
+    //  ROM and ERAM stay unmapped until a cartridge is loaded.
+    mapPages(mem, 0x0000, ERAM_END, NULL, NULL);
+    mapPages(mem, 0xC000, 0xFDFF, fastmem + 0xC000, fastmem + 0xC000);
+    //  OAM, IO, HRAM and IE share their pages with other regions.
+    mapPages(mem, OAM_BEG, IE, NULL, NULL);
+}
+
+uint8_t memRead(Memory *mem, uint16_t adr) {
+    const uint8_t *page = mem->read_map[adr >> 8];
+    if (page)
+        return page[adr & 0xFF];
+    PROFILE_ENTER(&mem->sched->reference->profile, PROFILE_MEMORY);
+    uint8_t val = readSlowMem(mem, adr);
+    PROFILE_LEAVE(&mem->sched->reference->profile);
+    return val;
+}
+
+void memWrite(Memory *mem, uint16_t adr, uint8_t val) {
+    uint8_t *page = mem->write_map[adr >> 8];
+    if (!page) {
+        PROFILE_ENTER(&mem->sched->reference->profile, PROFILE_MEMORY);
+        writeSlowMem(mem, adr, val);
+        PROFILE_LEAVE(&mem->sched->reference->profile);
+        return;
     }
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    if (size > KB(32)) {
-        fprintf(stderr, "rom file too large! Panicking!\n");
-        PANIC;
+    page[adr & 0xFF] = val;
+    if (mem->code_pages[adr >> 8])
+        invalidateBlockPage(&mem->sched->reference->block_cache,
+                            mem->code_pages, adr >> 8);
+}
+
+void destroyMemory(Memory *mem) { destroyCartridge(&mem->cart); }
+
+bool tryLoadROM(Memory *mem, const char *path) {
+    if (mem->boot_rom_path[0] == '\0') {
+        fprintf(stderr, "no boot rom specified!\n");
+        return false;
     }
-    rewind(file);
-    fread(mem->mmap.fastmem, 1, size, file);
-    memcpy(mem->unmapped_rom, mem->mmap.fastmem, 256);
-    fclose(file);
-    file = fopen(mem->boot_rom_path, "r");
+    FILE *file = fopen(mem->boot_rom_path, "r");
     if (!file) {
-        fprintf(stderr, "%s bootrom could not be found! Panicking!\n",
+        fprintf(stderr, "%s bootrom could not be found!\n",
                 mem->boot_rom_path);
-        PANIC;
+        return false;
+    }
+    if (!loadCartridge(&mem->cart, path)) {
+        fclose(file);
+        return false;
     }
     fread(mem->boot_rom, 1, 256, file);
-    memcpy(mem->mmap.fastmem, mem->boot_rom, 256);
     fclose(file);
+    mem->boot_rom_mapped = true;
+    mapCartridge(mem);
     strcpy(mem->rom_path, path);
+    return true;
+}
+
+void loadROM(Memory *mem, const char *path) {
+    if (!tryLoadROM(mem, path)) {
+        fprintf(stderr, "%s rom could not be loaded! Panicking!\n", path);
+        PANIC;
+    }
+}
+
+bool enableBatterySave(Memory *mem, uint32_t interval_ms) {
+    //  The save sits next to the ROM, with its extension replaced.
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path) - 4, "%s", mem->rom_path);
+    char *ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/'))
+        ext = path + strlen(path);
+    strcpy(ext, ".sav");
+    if (!attachCartridgeSave(&mem->cart, path, interval_ms))
+        return false;
+    mapCartridge(mem);
+    return true;
 }
 
 void setBootROM(Memory *mem, const char *path) {
@@ -283,5 +360,6 @@ void setBootROM(Memory *mem, const char *path) {
 }
 
 void unmountBootROM(Memory *mem) {
-    memcpy(mem->mmap.fastmem, mem->unmapped_rom, 256);
+    mem->boot_rom_mapped = false;
+    mapCartridge(mem);
 }
@@ -2,6 +2,7 @@
 #include <limits.h>
 #include <utility.h>
 #include <backend/scheduler.h>
+#include "cartridge.h"
 #define VRAM_BEG 0x8000
 #define VRAM_END 0x9FFF
 #define ERAM_BEG 0xA000
@@ -11,16 +12,25 @@
 #define IO_BEG 0xFF00
 #define IO_END 0xFF7F
 #define IE 0xFFFF
+#define MEM_PAGE_COUNT 256
+
+enum JoypadButton {
+    JOYPAD_A = BIT(0),
+    JOYPAD_B = BIT(1),
+    JOYPAD_SELECT = BIT(2),
+    JOYPAD_START = BIT(3),
+    JOYPAD_RIGHT = BIT(4),
+    JOYPAD_LEFT = BIT(5),
+    JOYPAD_UP = BIT(6),
+    JOYPAD_DOWN = BIT(7),
+};
 
 typedef struct {
     struct {
         struct {
             uint8_t vram[KB(8)];
-            uint8_t eram[KB(8)];
             uint8_t oam[OAM_END + 1 - OAM_BEG];
             struct {
-                uint8_t r_if, r_ie;
-                uint8_t div, tima, tma, tac;
                 uint8_t data[IO_END + 1 - IO_BEG];
             } io;
         } slowmem;
@@ -28,14 +38,34 @@ typedef struct {
     } mmap;
     char boot_rom_path[PATH_MAX];
     char rom_path[PATH_MAX];
+    //  Direct pointers to each 256 byte page, NULL pages are handled by
+    //  readSlowMem and writeSlowMem.
+    uint8_t *read_map[MEM_PAGE_COUNT];
+    uint8_t *write_map[MEM_PAGE_COUNT];
     uint8_t boot_rom[256];
-    uint8_t unmapped_rom[256];
+    bool boot_rom_mapped;
+    Cartridge cart;
+    //  Pages holding cached blocks, writes to them invalidate the cache.
+    uint8_t code_pages[256];
+    //  Currently pressed JoypadButtons.
+    uint8_t joypad;
     Scheduler *sched;
 } Memory;
 
+void initMemory(Memory *mem, Scheduler *sched);
+void destroyMemory(Memory *mem);
 uint8_t memRead(Memory *mem, uint16_t adr);
 void memWrite(Memory *mem, uint16_t adr, uint8_t val);
+//  Reads VRAM without syncing the PPU, for debug views.
+uint8_t peekVRAM(const Memory *mem, uint16_t adr);
 
 void loadROM(Memory *mem, const char *path);
+//  Same as loadROM, but returns false instead of panicking if the ROM or
+//  the boot ROM cannot be loaded.
+bool tryLoadROM(Memory *mem, const char *path);
+//  Persists battery-backed RAM to the .sav next to the loaded ROM, writing
+//  it asynchronously at most every interval_ms. Returns false if the cart
+//  has no battery.
+bool enableBatterySave(Memory *mem, uint32_t interval_ms);
 void setBootROM(Memory *mem, const char *path);
 void unmountBootROM(Memory *mem);
\ No newline at end of file
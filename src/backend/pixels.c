@@ -0,0 +1,200 @@
+#include "pixels.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+const uint32_t DMG_SHADES[4] = {0xFFFFFF, 0x999999, 0x444444, 0x000000};
+
+typedef void (*DecodeFunc)(const uint8_t *, uint8_t *, size_t);
+typedef void (*MapFunc)(const uint8_t *, const uint32_t *, uint32_t *,
+                        size_t);
+
+static void decodeScalar(const uint8_t *planes, uint8_t *out, size_t rows) {
+    for (size_t row = 0; row < rows; ++row, planes += 2, out += 8)
+        for (size_t x = 0; x < 8; ++x)
+            out[x] =
+                (planes[0] >> (7 - x) & 1) | (planes[1] >> (7 - x) & 1) << 1;
+}
+
+static void mapScalar(const uint8_t *indices, const uint32_t *palette,
+                      uint32_t *out, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        out[i] = palette[indices[i]];
+}
+
+#if defined(__x86_64__)
+
+//  Turns 16 bytes, each repeated over the 8 pixels of its row, into 0 or 1
+//  per pixel for the bit of that column.
+__attribute__((target("sse2"))) static __m128i
+columnBitsSSE2(__m128i repeated) {
+    const __m128i mask =
+        _mm_set_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                     0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+    __m128i set = _mm_cmpeq_epi8(_mm_and_si128(repeated, mask), mask);
+    return _mm_and_si128(set, _mm_set1_epi8(1));
+}
+
+//  One tile, 8 rows, per iteration.
+__attribute__((target("sse2"))) static void
+decodeSSE2(const uint8_t *planes, uint8_t *out, size_t rows) {
+    size_t row = 0;
+    for (; row + 8 <= rows; row += 8, planes += 16, out += 64) {
+        __m128i v = _mm_loadu_si128((const __m128i *)planes);
+        __m128i low = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+        __m128i high = _mm_srli_epi16(v, 8);
+        //  Low planes in bytes 0-7 and high planes in bytes 8-15.
+        __m128i packed = _mm_packus_epi16(low, high);
+        __m128i x2 = _mm_unpacklo_epi8(packed, packed);
+        __m128i y2 = _mm_unpackhi_epi8(packed, packed);
+        __m128i x4[2] = {_mm_unpacklo_epi16(x2, x2),
+                         _mm_unpackhi_epi16(x2, x2)};
+        __m128i y4[2] = {_mm_unpacklo_epi16(y2, y2),
+                         _mm_unpackhi_epi16(y2, y2)};
+        for (size_t i = 0; i < 2; ++i) {
+            __m128i lo01 = _mm_unpacklo_epi32(x4[i], x4[i]);
+            __m128i lo23 = _mm_unpackhi_epi32(x4[i], x4[i]);
+            __m128i hi01 = _mm_unpacklo_epi32(y4[i], y4[i]);
+            __m128i hi23 = _mm_unpackhi_epi32(y4[i], y4[i]);
+            __m128i h01 = columnBitsSSE2(hi01);
+            __m128i h23 = columnBitsSSE2(hi23);
+            _mm_storeu_si128(
+                (__m128i *)(out + i * 32),
+                _mm_or_si128(columnBitsSSE2(lo01), _mm_add_epi8(h01, h01)));
+            _mm_storeu_si128(
+                (__m128i *)(out + i * 32 + 16),
+                _mm_or_si128(columnBitsSSE2(lo23), _mm_add_epi8(h23, h23)));
+        }
+    }
+    decodeScalar(planes, out, rows - row);
+}
+
+//  SSE2 has no shuffle that could index the palette, so each lane selects
+//  its entry with masks built from the two index bits.
+__attribute__((target("sse2"))) static void
+mapSSE2(const uint8_t *indices, const uint32_t *palette, uint32_t *out,
+        size_t count) {
+    __m128i p0 = _mm_set1_epi32(palette[0]);
+    __m128i p2 = _mm_set1_epi32(palette[2]);
+    __m128i diff01 = _mm_xor_si128(p0, _mm_set1_epi32(palette[1]));
+    __m128i diff23 = _mm_xor_si128(p2, _mm_set1_epi32(palette[3]));
+    __m128i bit0 = _mm_set1_epi32(1);
+    __m128i bit1 = _mm_set1_epi32(2);
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i words = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(indices + i)), zero);
+        for (size_t half = 0; half < 2; ++half) {
+            __m128i idx = half ? _mm_unpackhi_epi16(words, zero)
+                               : _mm_unpacklo_epi16(words, zero);
+            __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(idx, bit0), bit0);
+            __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(idx, bit1), bit1);
+            __m128i lo = _mm_xor_si128(p0, _mm_and_si128(m0, diff01));
+            __m128i hi = _mm_xor_si128(p2, _mm_and_si128(m0, diff23));
+            __m128i pixel = _mm_xor_si128(
+                lo, _mm_and_si128(m1, _mm_xor_si128(lo, hi)));
+            _mm_storeu_si128((__m128i *)(out + i + half * 4), pixel);
+        }
+    }
+    mapScalar(indices + i, palette, out + i, count - i);
+}
+
+//  One tile per iteration, 4 rows per register.
+__attribute__((target("avx2"))) static void
+decodeAVX2(const uint8_t *planes, uint8_t *out, size_t rows) {
+    const __m256i mask = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i one = _mm256_set1_epi8(1);
+    //  Separates the planes: low bytes to 0-7, high bytes to 8-15.
+    const __m128i split =
+        _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    //  Repeats rows 0-1 over the lower lane and rows 2-3 over the upper one,
+    //  8 bytes each.
+    const __m256i repeat = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+        2, 3, 3, 3, 3, 3, 3, 3, 3);
+    size_t row = 0;
+    for (; row + 8 <= rows; row += 8, planes += 16, out += 64) {
+        __m128i v = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)planes), split);
+        __m256i lo = _mm256_broadcastq_epi64(v);
+        __m256i hi = _mm256_broadcastq_epi64(_mm_unpackhi_epi64(v, v));
+        for (size_t half = 0; half < 2; ++half) {
+            __m256i sel = _mm256_add_epi8(repeat, _mm256_set1_epi8(half * 4));
+            __m256i l = _mm256_shuffle_epi8(lo, sel);
+            __m256i h = _mm256_shuffle_epi8(hi, sel);
+            l = _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_and_si256(l, mask), mask), one);
+            h = _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_and_si256(h, mask), mask), one);
+            _mm256_storeu_si256((__m256i *)(out + half * 32),
+                                _mm256_or_si256(l, _mm256_add_epi8(h, h)));
+        }
+    }
+    //  The SSE2 and scalar code would pay for the dirty upper halves.
+    _mm256_zeroupper();
+    decodeScalar(planes, out, rows - row);
+}
+
+__attribute__((target("avx2"))) static void
+mapAVX2(const uint8_t *indices, const uint32_t *palette, uint32_t *out,
+        size_t count) {
+    __m256i colours = _mm256_setr_epi32(palette[0], palette[1], palette[2],
+                                        palette[3], palette[0], palette[1],
+                                        palette[2], palette[3]);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(indices + i));
+        __m256i a = _mm256_cvtepu8_epi32(bytes);
+        __m256i b = _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8));
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_permutevar8x32_epi32(colours, a));
+        _mm256_storeu_si256((__m256i *)(out + i + 8),
+                            _mm256_permutevar8x32_epi32(colours, b));
+    }
+    _mm256_zeroupper();
+    mapSSE2(indices + i, palette, out + i, count - i);
+}
+
+#endif
+
+static struct {
+    enum PixelISA isa;
+    DecodeFunc decode;
+    MapFunc map;
+} kernels = {PIXEL_ISA_SCALAR, decodeScalar, mapScalar};
+
+enum PixelISA selectPixelKernels(enum PixelISA max) {
+    kernels.isa = PIXEL_ISA_SCALAR;
+    kernels.decode = decodeScalar;
+    kernels.map = mapScalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (max >= PIXEL_ISA_AVX2 && __builtin_cpu_supports("avx2")) {
+        kernels.isa = PIXEL_ISA_AVX2;
+        kernels.decode = decodeAVX2;
+        kernels.map = mapAVX2;
+    } else if (max >= PIXEL_ISA_SSE2 && __builtin_cpu_supports("sse2")) {
+        kernels.isa = PIXEL_ISA_SSE2;
+        kernels.decode = decodeSSE2;
+        kernels.map = mapSSE2;
+    }
+#endif
+    return kernels.isa;
+}
+
+__attribute__((constructor)) static void initPixelKernels(void) {
+    selectPixelKernels(PIXEL_ISA_AVX2);
+}
+
+enum PixelISA pixelKernelISA(void) { return kernels.isa; }
+
+void decodeTileRows(const uint8_t *planes, uint8_t *out, size_t rows) {
+    kernels.decode(planes, out, rows);
+}
+
+void mapPixels(const uint8_t *indices, const uint32_t palette[4],
+               uint32_t *out, size_t count) {
+    kernels.map(indices, palette, out, count);
+}
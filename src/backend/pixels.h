@@ -0,0 +1,28 @@
+/*
+    Pixel kernels of the renderer: decoding 2bpp tile rows to one colour
+    index per pixel and mapping indices to XRGB8888 through a 4 entry
+    palette. There are scalar, SSE2 and AVX2 versions, the best one the host
+    supports is picked at startup.
+*/
+#pragma once
+#include <utility.h>
+
+enum PixelISA {
+    PIXEL_ISA_SCALAR = 0,
+    PIXEL_ISA_SSE2,
+    PIXEL_ISA_AVX2,
+};
+
+//  The 4 grey shades colour indices are shown in.
+extern const uint32_t DMG_SHADES[4];
+
+//  Switches to the best kernels the host supports up to max and returns
+//  the ones now in use.
+enum PixelISA selectPixelKernels(enum PixelISA max);
+enum PixelISA pixelKernelISA(void);
+
+//  planes holds the low and high bitplane byte of each row, out receives 8
+//  indices per row.
+void decodeTileRows(const uint8_t *planes, uint8_t *out, size_t rows);
+void mapPixels(const uint8_t *indices, const uint32_t palette[4],
+               uint32_t *out, size_t count);
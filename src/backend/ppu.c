@@ -1,10 +1,18 @@
 #include "ppu.h"
+#include <backend/cpu.h>
 #include <backend/events.h>
 #include <stdlib.h>
+#include <string.h>
+#include "pixels.h"
+#include "renderer.h"
 
 #define TILES_PER_ROW 20
 #define SPRITE_SIZE 4
 #define SPRITE_HEIGHT 8
+//  Line cycle of the last FIFO push, when a whole line is drawn at once.
+#define SCANLINE_RENDER_CYCLE (80 + RES_X)
+
+static const uint8_t BLANK_ROW[8];
 
 static int cmpSprites(const void *a, const void *b) {
     const struct SpriteStruct *_a = a;
@@ -17,7 +25,7 @@ static int cmpSprites(const void *a, const void *b) {
 __always_inline void checkLYC(PPU *ppu, Memory *mem) {
     if (ppu->ly == ppu->lyc) {
         if (ppu->stat & BIT(6)) {
-            eventSTATInterrupt(mem->sched);
+            requestInterrupt(mem->sched->reference, INTERRUPT_STAT);
         }
         ppu->stat |= BIT(2);
     } else
@@ -30,15 +38,15 @@ __always_inline void changeMode(PPU *ppu, Memory *mem, enum PPUMode mode) {
     switch (mode) {
     case PPUMODE0:
         if (ppu->stat & BIT(3))
-            eventSTATInterrupt(mem->sched);
+            requestInterrupt(mem->sched->reference, INTERRUPT_STAT);
         break;
     case PPUMODE1:
         if (ppu->stat & BIT(4))
-            eventSTATInterrupt(mem->sched);
+            requestInterrupt(mem->sched->reference, INTERRUPT_STAT);
         break;
     case PPUMODE2:
         if (ppu->stat & BIT(5))
-            eventSTATInterrupt(mem->sched);
+            requestInterrupt(mem->sched->reference, INTERRUPT_STAT);
         break;
     case PPUMODE3:
         break;
@@ -48,40 +56,88 @@ __always_inline void changeMode(PPU *ppu, Memory *mem, enum PPUMode mode) {
 }
 
 __attribute_warn_unused_result__ __always_inline uint32_t
-getPixelValue(PPU *ppu, uint8_t col_value, uint8_t bgp) {
-    size_t pixel_value = (bgp >> (col_value * 2)) & 0b11;
-    switch (col_value) {
-    case 0b00:
-        return 0xFFFFFF;
-    case 0b01:
-        return 0x999999;
-    case 0b10:
-        return 0x444444;
-    case 0b11:
-        return 0x000000;
+getPixelValue(const uint32_t *palette, uint8_t col_value) {
+    return palette[col_value & 0b11];
+}
+
+static void buildPalette(uint32_t palette[4], uint8_t val) {
+    for (uint32_t i = 0; i < 4; ++i)
+        palette[i] = DMG_SHADES[(val >> (i * 2)) & 0b11];
+}
+
+void initPPU(PPU *ppu) {
+    writePPURegister(ppu, IO_BGP, ppu->bgp);
+    writePPURegister(ppu, IO_OBP0, ppu->obp0);
+    writePPURegister(ppu, IO_OBP1, ppu->obp1);
+}
+
+//  Palette tables are only rebuilt here.
+void writePPURegister(PPU *ppu, uint8_t reg, uint8_t val) {
+    switch (reg) {
+    case IO_LCDC:
+        ppu->lcdc = val;
+        break;
+    case IO_SCY:
+        ppu->scy = val;
+        break;
+    case IO_SCX:
+        ppu->scx = val;
+        break;
+    case IO_BGP:
+        ppu->bgp = val;
+        buildPalette(ppu->bg_palette, val);
+        break;
+    case IO_OBP0:
+        ppu->obp0 = val;
+        buildPalette(ppu->obj_palettes[0], val);
+        break;
+    case IO_OBP1:
+        ppu->obp1 = val;
+        buildPalette(ppu->obj_palettes[1], val);
+        break;
+    case IO_WY:
+        ppu->wy = val;
+        break;
+    case IO_WX:
+        ppu->wx = val;
+        break;
     default:
         PANIC;
     }
-    return 0;
 }
 
-__always_inline void pushToLCD(PPU *ppu, uint8_t bgp) {
+__always_inline void pushToLCD(PPU *ppu, const uint32_t *obj_palette) {
+    bool sprites = false;
+    for (uint32_t x = 0; x < PIXEL_PER_FIFO; ++x)
+        sprites |= ppu->sprite_fifo[x].valid;
+    if (!sprites) {
+        uint32_t count = ppu->fifo_pixels_to_draw;
+        if (count + ppu->cur_x_pos > RES_X)
+            count = RES_X - ppu->cur_x_pos;
+        mapPixels(ppu->bgwn_fifo, ppu->bg_palette,
+                  &ppu->pixels[ppu->ly][ppu->cur_x_pos], count);
+        ppu->cur_x_pos += count;
+        memset(ppu->sprite_fifo, 0, sizeof(ppu->sprite_fifo));
+        memset(ppu->bgwn_fifo, 0, sizeof(ppu->bgwn_fifo));
+        return;
+    }
     for (uint32_t x = 0; x < ppu->fifo_pixels_to_draw && ppu->cur_x_pos < RES_X;
          ++x) {
         uint32_t pixel_colour;
         if (!ppu->sprite_fifo[x].valid || !ppu->sprite_fifo[x].col_val) {
-            pixel_colour = getPixelValue(ppu, ppu->bgwn_fifo[x], bgp);
+            pixel_colour = getPixelValue(ppu->bg_palette, ppu->bgwn_fifo[x]);
         } else {
             if (ppu->sprite_fifo[x].is_transparent) {
                 if (ppu->bgwn_fifo[x]) {
-                    pixel_colour = getPixelValue(ppu, ppu->bgwn_fifo[x], bgp);
-                } else {
                     pixel_colour =
-                        getPixelValue(ppu, ppu->sprite_fifo[x].col_val, bgp);
+                        getPixelValue(ppu->bg_palette, ppu->bgwn_fifo[x]);
+                } else {
+                    pixel_colour = getPixelValue(obj_palette,
+                                                 ppu->sprite_fifo[x].col_val);
                 }
             } else {
                 pixel_colour =
-                    getPixelValue(ppu, ppu->sprite_fifo[x].col_val, bgp);
+                    getPixelValue(obj_palette, ppu->sprite_fifo[x].col_val);
             }
         }
         ppu->pixels[ppu->ly][ppu->cur_x_pos++] = pixel_colour;
@@ -90,52 +146,45 @@ __always_inline void pushToLCD(PPU *ppu, uint8_t bgp) {
     memset(ppu->bgwn_fifo, 0, sizeof(ppu->bgwn_fifo));
 }
 
-__always_inline void updateFIFOBGWN(PPU *ppu) {
-    for (size_t x = 0; x < ppu->fifo_pixels_to_draw; ++x) {
-        bool low = ppu->fetcher.datalow & (BIT(7) >> x);
-        bool high = ppu->fetcher.datahigh & (BIT(7) >> x);
-        size_t pixel_value = low | (high << 1);
-        ppu->bgwn_fifo[x] = pixel_value;
-    }
+//  skip leading pixels of the fetched row are dropped.
+__always_inline void updateFIFOBGWN(PPU *ppu, uint8_t skip) {
+    memcpy(ppu->bgwn_fifo, &ppu->fetcher.pixels[skip],
+           ppu->fifo_pixels_to_draw);
 }
 
-__always_inline void updateFIFOSprite(PPU *ppu, uint8_t start_pos,
-                                      uint8_t count) {
+__always_inline void updateFIFOSprite(PPU *ppu, const uint8_t *pixels,
+                                      uint8_t start_pos, uint8_t count) {
     for (int32_t x = start_pos; x < start_pos + count && x < PIXEL_PER_FIFO;
          ++x) {
-        bool low = ppu->fetcher.datalow & (BIT(7) >> x);
-        bool high = ppu->fetcher.datahigh & (BIT(7) >> x);
-        size_t pixel_value = low | (high << 1);
-        ppu->sprite_fifo[x].col_val = pixel_value;
+        ppu->sprite_fifo[x].col_val = pixels[x];
         ppu->sprite_fifo[x].valid = true;
     }
 }
 
-__always_inline void fetchTileDataBGWN(PPU *ppu, Memory *mem) {
-    bool mode_8000 = ppu->lcdc & BIT(4);
+//  Index into the tile cache of a BG or window tile number.
+__always_inline uint16_t tileIndexBGWN(const PPU *ppu, uint8_t tile_n) {
+    return ppu->lcdc & BIT(4) ? tile_n : 256 + (int8_t)tile_n;
+}
+
+__always_inline void fetchTileDataBGWN(PPU *ppu, const uint8_t *vram) {
     uint16_t offset =
         ppu->is_window_drawing ? ppu->window_ly + ppu->wy : ppu->scy + ppu->ly;
-    uint16_t address;
-    if (mode_8000) {
-        address = 0x8000 + ppu->fetcher.tile_n * 16 + (offset % 8) * 2;
-    } else {
-        address =
-            0x9000 + ((int8_t)ppu->fetcher.tile_n) * 16 + (offset % 8) * 2;
-    }
-    ppu->fetcher.datalow = memRead(mem, address);
-    ppu->fetcher.datahigh = memRead(mem, address + 1);
+    memcpy(ppu->fetcher.pixels,
+           tileRow(&ppu->tiles, vram, tileIndexBGWN(ppu, ppu->fetcher.tile_n),
+                   offset % 8, false),
+           sizeof(ppu->fetcher.pixels));
 }
 
-__always_inline void fetchTileDataSprite(PPU *ppu, Memory *mem,
+__always_inline void fetchTileDataSprite(PPU *ppu, const uint8_t *vram,
                                          const struct SpriteStruct *sprite) {
     uint16_t offset = ppu->ly - sprite->y_pos;
-    ppu->fetcher.datalow =
-        memRead(mem, 0x8000 + ppu->fetcher.tile_n * 16 + (offset % 8) * 2);
-    ppu->fetcher.datahigh =
-        memRead(mem, 0x8000 + ppu->fetcher.tile_n * 16 + (offset % 8) * 2 + 1);
+    memcpy(ppu->fetcher.pixels,
+           tileRow(&ppu->tiles, vram, ppu->fetcher.tile_n, offset % 8,
+                   sprite->flags & BIT(5)),
+           sizeof(ppu->fetcher.pixels));
 }
 
-static void fetchTileNumberBGWN(PPU *ppu, Memory *mem) {
+static void fetchTileNumberBGWN(PPU *ppu, const uint8_t *vram) {
     uint8_t offset_y =
         ppu->is_window_drawing ? ppu->window_ly : ppu->scy + ppu->ly;
     uint8_t offset_x = (ppu->is_window_drawing ? ppu->fetcher.x - (ppu->wx - 7)
@@ -146,44 +195,36 @@ static void fetchTileNumberBGWN(PPU *ppu, Memory *mem) {
         adr += 0x9C00;
     else
         adr += 0x9800;
-    ppu->fetcher.tile_n = memRead(mem, adr);
+    ppu->fetcher.tile_n = vram[adr - VRAM_BEG];
 }
 
-static uint32_t loadFetcherBGWN(PPU *ppu, Memory *mem) {
+static uint32_t loadFetcherBGWN(PPU *ppu, const uint8_t *vram) {
     ppu->is_window_drawing = ppu->is_window_drawing
                                  ? ppu->is_window_drawing
                                  : ppu->lcdc & BIT(5) && ppu->ly >= ppu->wy &&
                                        ppu->fetcher.x >= ppu->wx - 7;
     ppu->increment_wly =
         ppu->increment_wly ? ppu->increment_wly : ppu->is_window_drawing;
-    fetchTileNumberBGWN(ppu, mem);
-    fetchTileDataBGWN(ppu, mem);
-    if ((ppu->lcdc & BIT(0)) == false) {
-        ppu->fetcher.datahigh = 0;
-        ppu->fetcher.datalow = 0;
-    }
+    fetchTileNumberBGWN(ppu, vram);
+    fetchTileDataBGWN(ppu, vram);
+    if ((ppu->lcdc & BIT(0)) == false)
+        memset(ppu->fetcher.pixels, 0, sizeof(ppu->fetcher.pixels));
     ppu->is_window_drawing = false;
 }
 
-static void updateBGWN(PPU *ppu, Memory *mem) {
-    loadFetcherBGWN(ppu, mem);
-    if (!ppu->fetcher.x) {
-        uint8_t shift = ppu->scx % 8;
-        ppu->fifo_pixels_to_draw = 8 - shift;
-        ppu->fetcher.datahigh <<= shift;
-        ppu->fetcher.datalow <<= shift;
-    } else {
-        ppu->fifo_pixels_to_draw = 8;
-    }
-    updateFIFOBGWN(ppu);
+static void updateBGWN(PPU *ppu, const uint8_t *vram) {
+    loadFetcherBGWN(ppu, vram);
+    uint8_t shift = ppu->fetcher.x ? 0 : ppu->scx % 8;
+    ppu->fifo_pixels_to_draw = 8 - shift;
+    updateFIFOBGWN(ppu, shift);
 }
 
-static void fetchSprites(PPU *ppu, Memory *mem) {
+static void fetchSprites(PPU *ppu, const uint8_t *oam) {
     memset(ppu->sprites, 0, sizeof(ppu->sprites));
     uint32_t added_sprites = 0;
     for (uint16_t oami = 0; oami < OAM_END - OAM_BEG; oami += SPRITE_SIZE) {
         struct SpriteStruct sprite;
-        memcpy(&sprite, &mem->mmap.slowmem.oam[oami], SPRITE_SIZE);
+        memcpy(&sprite, &oam[oami], SPRITE_SIZE);
         uint8_t y = sprite.y_pos - 16;
         uint8_t height = ppu->lcdc & BIT(2) ? 16 : 8;
         if (y <= ppu->ly && y + 8 > ppu->ly && sprite.x_pos > 0)
@@ -194,7 +235,7 @@ static void fetchSprites(PPU *ppu, Memory *mem) {
     // qsort(ppu->sprites, added_sprites, SPRITE_SIZE, cmpSprites);
 }
 
-static bool renderSprite(PPU *ppu, Memory *mem, struct SpriteStruct *sprite) {
+static bool renderSprite(PPU *ppu, struct SpriteStruct *sprite) {
     if (ppu->lcdc & BIT(1) == 0 && ppu->ly)
         return false;
     if (ppu->sprites[0].x_pos) {
@@ -218,21 +259,25 @@ static bool renderSprite(PPU *ppu, Memory *mem, struct SpriteStruct *sprite) {
     return false;
 }
 
-static void updateSprite(PPU *ppu, Memory *mem,
+static void updateSprite(PPU *ppu, const uint8_t *vram,
                          const struct SpriteStruct *sprite) {
     ppu->fetcher.tile_n = sprite->tile_n;
-    fetchTileDataSprite(ppu, mem, sprite);
+    fetchTileDataSprite(ppu, vram, sprite);
     if (ppu->fetcher.x <= sprite->x_pos - 8) {
-        updateFIFOSprite(ppu, sprite->x_pos - 8 - ppu->fetcher.x, 8);
+        updateFIFOSprite(ppu, ppu->fetcher.pixels,
+                         sprite->x_pos - 8 - ppu->fetcher.x, 8);
     } else {
         uint32_t pixels = sprite->x_pos - ppu->fetcher.x;
-        ppu->fetcher.datahigh <<= 8 - pixels;
-        ppu->fetcher.datalow <<= 8 - pixels;
-        updateFIFOSprite(ppu, 0, pixels);
+        updateFIFOSprite(ppu, &ppu->fetcher.pixels[8 - pixels], 0, pixels);
     }
 }
 
-static void ppuMode1(PPU *ppu, Memory *mem) { changeMode(ppu, mem, PPUMODE1); }
+//  Entered once per frame, at the start of line 144.
+static void ppuMode1(PPU *ppu, Memory *mem) {
+    requestInterrupt(mem->sched->reference, INTERRUPT_VBLANK);
+    changeMode(ppu, mem, PPUMODE1);
+    checkLYC(ppu, mem);
+}
 
 static void ppuMode2(PPU *ppu, Memory *mem) {
     changeMode(ppu, mem, PPUMODE2);
@@ -241,7 +286,7 @@ static void ppuMode2(PPU *ppu, Memory *mem) {
 
 static void ppuMode3(PPU *ppu, Memory *mem) { changeMode(ppu, mem, PPUMODE3); }
 
-static void endOfScanline(PPU *ppu, Memory *mem) {
+static void endOfScanline(PPU *ppu) {
     ppu->window_ly += ppu->increment_wly;
     ++ppu->ly;
     ppu->fetcher.x = 0;
@@ -250,59 +295,282 @@ static void endOfScanline(PPU *ppu, Memory *mem) {
     memset(ppu->sprites, 0, sizeof(ppu->sprites));
 }
 
+//  Starts or stops the render worker as requested, otherwise trades it the
+//  frame that just ended for the one before.
+static void updateRenderWorker(PPU *ppu, Memory *mem) {
+    if (!ppu->worker) {
+        if (ppu->render_thread)
+            ppu->worker = createRenderWorker(ppu, mem->mmap.slowmem.vram,
+                                             mem->mmap.slowmem.oam);
+        return;
+    }
+    //  When stopping, the frame just ended is waited for, the next one is
+    //  drawn here again.
+    swapRenderFrame(ppu->worker, ppu->pixels, !ppu->render_thread);
+    if (!ppu->render_thread) {
+        destroyRenderWorker(ppu->worker);
+        ppu->worker = NULL;
+    }
+}
+
 static void endOfFrame(PPU *ppu, Memory *mem) {
     ppu->ly = 0;
     ppu->window_ly = 0;
     ppu->cycles = 0;
-    changeMode(ppu, mem, PPUMODE2);
-    updateWindows(ppu->pixels, RES_X);
-    SDL_Delay(30);
+    ppuMode2(ppu, mem);
+    ++ppu->frame_count;
+    updateRenderWorker(ppu, mem);
+    if (ppu->on_frame)
+        ppu->on_frame(&ppu->pixels[0][0], RES_X, ppu->frame_user);
+}
+
+//  Renders the next 8 pixel group through the fetcher and FIFO.
+static void pushFIFO(PPU *ppu, const uint8_t *vram) {
+    const uint32_t *obj_palette = ppu->obj_palettes[0];
+    // struct SpriteStruct sprite;
+    // if (renderSprite(ppu, &sprite)) {
+    //    obj_palette = ppu->obj_palettes[sprite.flags >> 4 & 1];
+    //    updateSprite(ppu, vram, &sprite);
+    //}
+    updateBGWN(ppu, vram);
+    pushToLCD(ppu, obj_palette);
+    ppu->fifo_timestamp += 8;
+    ppu->fetcher.x += 8;
+}
+
+/*
+    Draws the whole line in one pass, giving exactly what the FIFO pushes
+    would have. Only valid while nothing it reads was written since mode 3
+    began, the registers are then the same for every push.
+*/
+static void renderScanline(PPU *ppu, const uint8_t *vram) {
+    bool window_line = ppu->lcdc & BIT(5) && ppu->ly >= ppu->wy;
+    int32_t window_x = ppu->wx - 7;
+    uint8_t bg_y = ppu->scy + ppu->ly;
+    const uint8_t *bg_map = vram + (ppu->lcdc & BIT(3) ? 0x1C00 : 0x1800) +
+                            (bg_y / 8 % 32) * 32;
+    const uint8_t *wn_map = vram + (ppu->lcdc & BIT(6) ? 0x1C00 : 0x1800) +
+                            (ppu->window_ly / 8 % 32) * 32;
+    //  The window row of the tile data is offset by WY, as in the fetcher.
+    uint8_t bg_row = bg_y % 8;
+    uint8_t wn_row = (ppu->window_ly + ppu->wy) % 8;
+    uint8_t indices[RES_X];
+    for (uint32_t x = 0; x < RES_X; x += PIXEL_PER_FIFO) {
+        bool window = window_line && (int32_t)x >= window_x;
+        ppu->increment_wly |= window;
+        uint8_t tile_x = window ? x - window_x : x + ppu->scx;
+        uint8_t tile_n = (window ? wn_map : bg_map)[tile_x / 8 % 32];
+        const uint8_t *pixels = BLANK_ROW;
+        if (ppu->lcdc & BIT(0))
+            pixels = tileRow(&ppu->tiles, vram, tileIndexBGWN(ppu, tile_n),
+                             window ? wn_row : bg_row, false);
+        memcpy(&indices[x], pixels, PIXEL_PER_FIFO);
+    }
+    //  The fine scroll drops the first pixels, the line's tail is not drawn.
+    uint32_t skip = ppu->scx % 8;
+    mapPixels(&indices[skip], ppu->bg_palette, ppu->pixels[ppu->ly],
+              RES_X - skip);
+    ppu->cur_x_pos = RES_X - skip;
+    ppu->fifo_pixels_to_draw = PIXEL_PER_FIFO;
+    ppu->fifo_timestamp += RES_X;
+    ppu->fetcher.x = RES_X;
+}
+
+//  Moves the next step to line_cycles into the current line.
+static void setStep(PPU *ppu, enum PPUStep step, uint32_t line_cycles) {
+    ppu->step = step;
+    ppu->step_cycles =
+        ppu->cycles - ppu->cycles % SCANLINE_MAX_CYCLES + line_cycles;
 }
 
-void ppuTick(PPU *ppu, Memory *mem) {
-    if ((ppu->lcdc & BIT(7)) == 0)
+void ppuFallBackToFIFO(PPU *ppu, Memory *mem) {
+    if (!ppu->scanline_pending)
         return;
+    ppu->scanline_pending = false;
+    //  Replay the pushes already due, nothing changed since mode 3 began.
     uint32_t scanline_cycles = ppu->cycles % SCANLINE_MAX_CYCLES;
-    if (scanline_cycles < 80) {
-        if (scanline_cycles == 0)
-            ppuMode2(ppu, mem);
-        else if (scanline_cycles + 1 == 80)
-            fetchSprites(ppu, mem);
-    } else if (ppu->ly < RES_Y && scanline_cycles >= 80) {
-        if (scanline_cycles == 80) {
-            ppuMode3(ppu, mem);
-            ppu->fifo_timestamp = scanline_cycles + 8;
+    while (ppu->fetcher.x < RES_X && ppu->fifo_timestamp < scanline_cycles)
+        pushFIFO(ppu, mem->mmap.slowmem.vram);
+    //  The last push is on the render tick, which has not run yet.
+    setStep(ppu, PPUSTEP_PIXELS, ppu->fifo_timestamp);
+}
+
+//  Runs the step due on this tick and works out when the next one is.
+static void runStep(PPU *ppu, Memory *mem) {
+    uint32_t scanline_cycles = ppu->cycles % SCANLINE_MAX_CYCLES;
+    switch (ppu->step) {
+    case PPUSTEP_MODE2:
+        ppuMode2(ppu, mem);
+        setStep(ppu, PPUSTEP_SPRITES, 80 - 1);
+        break;
+    case PPUSTEP_SPRITES:
+        if (!ppu->worker)
+            fetchSprites(ppu, mem->mmap.slowmem.oam);
+        setStep(ppu, PPUSTEP_MODE3, 80);
+        break;
+    case PPUSTEP_MODE3:
+        ppuMode3(ppu, mem);
+        if (ppu->worker) {
+            //  Mode 3 lasts as long as when the pixels are drawn here.
+            setStep(ppu, PPUSTEP_MODE0, SCANLINE_RENDER_CYCLE + 1);
+            break;
         }
-        if (ppu->fetcher.x < RES_X) {
-            uint8_t bgp = ppu->bgp;
-            if (scanline_cycles >= ppu->fifo_timestamp) {
-                struct SpriteStruct sprite;
-                // if (renderSprite(ppu, mem, &sprite)) {
-                //    bgp = sprite.flags & BIT(4) ? ppu->obp1 : ppu->obp0;
-                //    updateSprite(ppu, mem, &sprite);
-                //}
-                updateBGWN(ppu, mem);
-                pushToLCD(ppu, bgp);
-                ppu->fifo_timestamp += 8;
-                ppu->fetcher.x += 8;
-            }
-        } else if (scanline_cycles + 1 >= SCANLINE_MAX_CYCLES) {
-            endOfScanline(ppu, mem);
-            struct SpriteStruct sprite;
-            for (uint32_t i = 0; i < 10; ++i) {
-                memcpy(&sprite, &ppu->sprite_fifo[i], sizeof(sprite));
-                if (sprite.x_pos) {
-                    uint32_t pixel_colour =
-                        getPixelValue(ppu, , bgp);
-                }
-            }
-        } else if (ppu->cur_mode != PPUMODE0) {
-            changeMode(ppu, mem, PPUMODE0);
+        ppu->fifo_timestamp = scanline_cycles + 8;
+        ppu->scanline_pending = true;
+        //  Drawn on the tick of the last FIFO push.
+        setStep(ppu, PPUSTEP_PIXELS, SCANLINE_RENDER_CYCLE);
+        break;
+    case PPUSTEP_PIXELS:
+        if (ppu->scanline_pending) {
+            ppu->scanline_pending = false;
+            renderScanline(ppu, mem->mmap.slowmem.vram);
+        } else {
+            pushFIFO(ppu, mem->mmap.slowmem.vram);
         }
-    } else if (ppu->cycles + 1 >= FRAME_MAX_CYCLES) {
-        endOfFrame(ppu, mem);
-    } else if (ppu->cur_mode != PPUMODE1) {
+        if (ppu->fetcher.x < RES_X)
+            setStep(ppu, PPUSTEP_PIXELS, ppu->fifo_timestamp);
+        else
+            setStep(ppu, PPUSTEP_MODE0, scanline_cycles + 1);
+        break;
+    case PPUSTEP_MODE0:
+        changeMode(ppu, mem, PPUMODE0);
+        setStep(ppu, PPUSTEP_LINE_END, SCANLINE_MAX_CYCLES - 1);
+        break;
+    case PPUSTEP_LINE_END:
+        endOfScanline(ppu);
+        setStep(ppu, ppu->ly < RES_Y ? PPUSTEP_MODE2 : PPUSTEP_MODE1,
+                SCANLINE_MAX_CYCLES);
+        break;
+    case PPUSTEP_MODE1:
         ppuMode1(ppu, mem);
+        setStep(ppu, PPUSTEP_VBLANK_LINE_END, SCANLINE_MAX_CYCLES - 1);
+        break;
+    case PPUSTEP_VBLANK_LINE_END:
+        ++ppu->ly;
+        checkLYC(ppu, mem);
+        //  The last line ends the frame instead, which wraps LY to 0.
+        setStep(ppu,
+                ppu->ly + 1 < LINES_PER_FRAME ? PPUSTEP_VBLANK_LINE_END
+                                              : PPUSTEP_FRAME_END,
+                2 * SCANLINE_MAX_CYCLES - 1);
+        break;
+    case PPUSTEP_FRAME_END:
+        endOfFrame(ppu, mem);
+        //  Mode 2 was entered already, the tick counted below is its first.
+        setStep(ppu, PPUSTEP_SPRITES, 80 - 1);
+        break;
+    default:
+        PANIC;
     }
     ++ppu->cycles;
-}
\ No newline at end of file
+}
+
+void ppuSync(PPU *ppu, Memory *mem, uint64_t t_cycles) {
+    if (ppu->synced_cycles >= t_cycles)
+        return;
+    //  The LCD is only switched on or off by writes, which sync first.
+    if ((ppu->lcdc & BIT(7)) == 0) {
+        ppu->synced_cycles = t_cycles;
+        return;
+    }
+    PROFILE_ENTER(&mem->sched->reference->profile, PROFILE_PPU);
+    while (true) {
+        uint64_t due = ppu->synced_cycles + (ppu->step_cycles - ppu->cycles);
+        if (due >= t_cycles)
+            break;
+        ppu->cycles = ppu->step_cycles;
+        ppu->synced_cycles = due + 1;
+        runStep(ppu, mem);
+    }
+    ppu->cycles += t_cycles - ppu->synced_cycles;
+    ppu->synced_cycles = t_cycles;
+    PROFILE_LEAVE(&mem->sched->reference->profile);
+}
+
+//  Frame cycle of the next step that can raise an interrupt, change the
+//  mode or end the frame. Mode 3 raises nothing, but the idle loop skipper
+//  relies on STAT only changing at a deadline. The LY increment of visible
+//  lines is left to the next sync, mode 2 follows on the next tick.
+static uint32_t nextEventCycles(const PPU *ppu) {
+    switch (ppu->step) {
+    case PPUSTEP_SPRITES:
+        return ppu->step_cycles + 1;
+    case PPUSTEP_PIXELS:
+        //  One FIFO push every 8 cycles, mode 0 follows the tick after the
+        //  last one.
+        if (ppu->scanline_pending)
+            return ppu->step_cycles + 1;
+        return ppu->step_cycles + (RES_X - PIXEL_PER_FIFO - ppu->fetcher.x) +
+               1;
+    case PPUSTEP_LINE_END:
+        return ppu->step_cycles + 1;
+    default:
+        return ppu->step_cycles;
+    }
+}
+
+uint32_t ppuCyclesUntilEvent(const PPU *ppu) {
+    return nextEventCycles(ppu) - ppu->cycles + 1;
+}
+
+//  Position in a frame's log while it is replayed.
+struct Replay {
+    PPU *ppu;
+    uint8_t *vram, *oam;
+    const struct RenderLog *log;
+    size_t next;
+};
+
+//  Applies the writes made before the tick on frame cycle cycles ran.
+static void replayWrites(struct Replay *replay, uint32_t cycles) {
+    const struct RenderLog *log = replay->log;
+    for (; replay->next < log->count; ++replay->next) {
+        const struct RenderWrite *write = &log->writes[replay->next];
+        if (write->cycles > cycles)
+            break;
+        switch (write->adr) {
+        case VRAM_BEG ... VRAM_END:
+            replay->vram[write->adr - VRAM_BEG] = write->val;
+            markTileDirty(&replay->ppu->tiles, write->adr - VRAM_BEG);
+            break;
+        case OAM_BEG ... OAM_END:
+            replay->oam[write->adr - OAM_BEG] = write->val;
+            break;
+        default:
+            writePPURegister(replay->ppu, write->adr - IO_BEG, write->val);
+        }
+    }
+}
+
+//  Whether a write lands in mode 3 of the line beginning at line_beg.
+static bool writesInMode3(const struct Replay *replay, uint32_t line_beg) {
+    return replay->next < replay->log->count &&
+           replay->log->writes[replay->next].cycles <=
+               line_beg + SCANLINE_RENDER_CYCLE;
+}
+
+//  Follows the pixel steps of runStep, so the frame comes out the same as
+//  when drawn on the emulation thread.
+void ppuReplayFrame(PPU *ppu, uint8_t *vram, uint8_t *oam,
+                    const struct RenderLog *log) {
+    struct Replay replay = {ppu, vram, oam, log, 0};
+    for (uint32_t line = 0; line < RES_Y; ++line) {
+        uint32_t line_beg = line * SCANLINE_MAX_CYCLES;
+        replayWrites(&replay, line_beg + 80 - 1);
+        fetchSprites(ppu, oam);
+        replayWrites(&replay, line_beg + 80);
+        ppu->fifo_timestamp = 80 + 8;
+        if (!writesInMode3(&replay, line_beg)) {
+            renderScanline(ppu, vram);
+        } else {
+            while (ppu->fetcher.x < RES_X) {
+                replayWrites(&replay, line_beg + ppu->fifo_timestamp);
+                pushFIFO(ppu, vram);
+            }
+        }
+        endOfScanline(ppu);
+    }
+    replayWrites(&replay, UINT32_MAX);
+    ppu->ly = 0;
+    ppu->window_ly = 0;
+}
@@ -1,16 +1,30 @@
 #pragma once
 #include <utility.h>
 #include "memory.h"
-#include <frontend/display.h>
+#include "tilecache.h"
 
 #define RES_X 160
 #define RES_Y 144
 #define SCANLINE_MAX_CYCLES 456
-#define FRAME_MAX_CYCLES (SCANLINE_MAX_CYCLES * 154)
+#define LINES_PER_FRAME 154
+#define FRAME_MAX_CYCLES (SCANLINE_MAX_CYCLES * LINES_PER_FRAME)
 #define FRAME_CYCLES_BEFORE_VBLANK (SCANLINE_MAX_CYCLES * 144)
 #define MAX_SPRITES_PER_SCANLINE 10
 #define PIXEL_PER_FIFO 8
 
+//  PPU registers, as offsets from IO_BEG.
+#define IO_LCDC 0x40
+#define IO_STAT 0x41
+#define IO_SCY 0x42
+#define IO_SCX 0x43
+#define IO_LY 0x44
+#define IO_LYC 0x45
+#define IO_BGP 0x47
+#define IO_OBP0 0x48
+#define IO_OBP1 0x49
+#define IO_WY 0x4A
+#define IO_WX 0x4B
+
 enum PPUMode {
     PPUMODE0 = 0,
     PPUMODE1,
@@ -18,11 +32,25 @@ enum PPUMode {
     PPUMODE3,
 };
 
+//  Ticks of a line on which the PPU does anything, everything in between
+//  only advances the cycle counter.
+enum PPUStep {
+    PPUSTEP_MODE2 = 0,
+    PPUSTEP_SPRITES,
+    PPUSTEP_MODE3,
+    PPUSTEP_PIXELS,
+    PPUSTEP_MODE0,
+    PPUSTEP_LINE_END,
+    PPUSTEP_MODE1,
+    PPUSTEP_VBLANK_LINE_END,
+    PPUSTEP_FRAME_END,
+};
+
 struct PixelFetcher {
     uint8_t x;
     uint8_t tile_n;
-    uint8_t datalow;
-    uint8_t datahigh;
+    //  Colour indices of the fetched tile row.
+    uint8_t pixels[8];
 };
 
 __attribute__((packed)) struct SpriteStruct {
@@ -41,6 +69,26 @@ struct SpritePixel {
 _Static_assert(sizeof(struct SpriteStruct) == 4,
                "invalid size for sprite struct.");
 
+//  A write to VRAM, OAM or a PPU register that can change the picture,
+//  stamped with the frame cycle it landed on.
+struct RenderWrite {
+    uint32_t cycles;
+    uint16_t adr;
+    uint8_t val;
+};
+
+//  Writes of one frame in the order they were made.
+struct RenderLog {
+    struct RenderWrite *writes;
+    size_t count, capacity;
+};
+
+typedef struct RenderWorker RenderWorker;
+
+//  Called with the finished frame whenever the PPU leaves V-Blank.
+typedef void (*FrameCallback)(const uint32_t *pixels, size_t row_length,
+                              void *user);
+
 typedef struct {
     uint8_t lcdc, stat;
     uint8_t scx, scy;
@@ -51,15 +99,53 @@ typedef struct {
     uint8_t fifo_pixels_to_draw;
     uint8_t cur_x_pos;
     uint32_t cycles;
+    //  Next step and the value of cycles it runs on.
+    enum PPUStep step;
+    uint32_t step_cycles;
+    //  CPU cycle up to which the PPU has been run.
+    uint64_t synced_cycles;
     uint8_t bgp;
     uint8_t obp0, obp1;
+    //  Shade of each colour index under BGP, OBP0 and OBP1, rebuilt whenever
+    //  the register is written.
+    uint32_t bg_palette[4];
+    uint32_t obj_palettes[2][4];
     bool increment_wly;
     bool is_window_drawing;
+    //  Set while the current line is left to the scanline renderer.
+    bool scanline_pending;
     struct SpritePixel sprite_fifo[PIXEL_PER_FIFO];
     uint32_t pixels[RES_Y][RES_X];
     struct PixelFetcher fetcher;
     enum PPUMode cur_mode;
     struct SpriteStruct sprites[MAX_SPRITES_PER_SCANLINE];
+    uint64_t frame_count;
+    TileCache tiles;
+    FrameCallback on_frame;
+    void *frame_user;
+    //  Whether frames should be drawn on a worker thread, applied between
+    //  frames. worker is set while they are.
+    bool render_thread;
+    RenderWorker *worker;
 } PPU;
 
-void ppuTick(PPU *ppu, Memory *mem);
+void initPPU(PPU *ppu);
+//  Stores to one of the registers the pixels are drawn from.
+void writePPURegister(PPU *ppu, uint8_t reg, uint8_t val);
+//  Called before a write that can change how the current line looks. A line
+//  left to the scanline renderer is finished by the FIFO instead.
+void ppuFallBackToFIFO(PPU *ppu, Memory *mem);
+
+/*
+    Runs the PPU until it has caught up with t_cycles. Only the ticks of
+    steps are run, the ones in between are added to the counter at once.
+*/
+void ppuSync(PPU *ppu, Memory *mem, uint64_t t_cycles);
+//  Cycles until just after the next mode change that can raise an interrupt
+//  or end the frame, when the ePPU_MODE event is due.
+uint32_t ppuCyclesUntilEvent(const PPU *ppu);
+
+//  Draws a frame from its log on a PPU that does nothing but draw, see
+//  renderer.h. VRAM and OAM are updated along with the registers.
+void ppuReplayFrame(PPU *ppu, uint8_t *vram, uint8_t *oam,
+                    const struct RenderLog *log);
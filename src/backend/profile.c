@@ -0,0 +1,25 @@
+#include "profile.h"
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+static uint64_t profileTicks(void) {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+uint8_t switchProfileZone(Profile *profile, uint8_t zone) {
+    uint64_t now = profileTicks();
+    if (profile->last)
+        profile->ticks[profile->zone] += now - profile->last;
+    profile->last = now;
+    uint8_t prev = profile->zone;
+    profile->zone = zone;
+    return prev;
+}
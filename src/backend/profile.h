@@ -0,0 +1,34 @@
+/*
+    Coarse per-instance profiler used by cgb_bench. Time is attributed to
+    whichever zone is active; only builds with CGB_PROFILE defined switch
+    zones, otherwise the macros compile to nothing.
+*/
+#pragma once
+#include <utility.h>
+
+enum ProfileZone {
+    PROFILE_CPU = 0,
+    PROFILE_PPU,
+    //  Slow-path accesses: IO, VRAM, OAM and MBC registers.
+    PROFILE_MEMORY,
+    PROFILE_SCHEDULER,
+    PROFILE_ZONE_COUNT,
+};
+
+typedef struct {
+    uint64_t ticks[PROFILE_ZONE_COUNT];
+    uint64_t last;
+    uint8_t zone;
+} Profile;
+
+//  Makes zone active and returns the previously active one.
+uint8_t switchProfileZone(Profile *profile, uint8_t zone);
+
+#ifdef CGB_PROFILE
+#define PROFILE_ENTER(profile, zone)                                           \
+    uint8_t _profile_prev = switchProfileZone(profile, zone)
+#define PROFILE_LEAVE(profile) switchProfileZone(profile, _profile_prev)
+#else
+#define PROFILE_ENTER(profile, zone)
+#define PROFILE_LEAVE(profile)
+#endif
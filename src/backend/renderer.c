@@ -0,0 +1,116 @@
+#include "renderer.h"
+#include <pthread.h>
+#include <string.h>
+
+//  Writes a log starts out with room for, it doubles when full.
+#define LOG_MIN_CAPACITY 1024
+
+struct RenderWorker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    //  Filled by the emulation thread during the current frame.
+    struct RenderLog recording;
+    //  Replayed by the worker, left alone by the emulation thread while
+    //  busy is set.
+    struct RenderLog replaying;
+    bool busy, quit;
+    //  Whether pixels holds a finished frame yet.
+    bool drawn;
+    //  Only ever drawn from, its timing is not used.
+    PPU ppu;
+    uint8_t vram[KB(8)];
+    uint8_t oam[OAM_END + 1 - OAM_BEG];
+};
+
+static void *runWorker(void *input) {
+    RenderWorker *worker = input;
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        while (!worker->busy && !worker->quit)
+            pthread_cond_wait(&worker->wake, &worker->lock);
+        if (!worker->busy)
+            break;
+        pthread_mutex_unlock(&worker->lock);
+        ppuReplayFrame(&worker->ppu, worker->vram, worker->oam,
+                       &worker->replaying);
+        pthread_mutex_lock(&worker->lock);
+        worker->busy = false;
+        pthread_cond_signal(&worker->done);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+RenderWorker *createRenderWorker(const PPU *ppu, const uint8_t *vram,
+                                 const uint8_t *oam) {
+    RenderWorker *worker = calloc(1, sizeof(*worker));
+    if (!worker)
+        PANIC;
+    worker->ppu = *ppu;
+    worker->ppu.on_frame = NULL;
+    worker->ppu.render_thread = false;
+    worker->ppu.worker = NULL;
+    memcpy(worker->vram, vram, sizeof(worker->vram));
+    memcpy(worker->oam, oam, sizeof(worker->oam));
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->wake, NULL);
+    pthread_cond_init(&worker->done, NULL);
+    if (pthread_create(&worker->thread, NULL, runWorker, worker))
+        PANIC;
+    return worker;
+}
+
+void destroyRenderWorker(RenderWorker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->quit = true;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->wake);
+    pthread_cond_destroy(&worker->done);
+    free(worker->recording.writes);
+    free(worker->replaying.writes);
+    free(worker);
+}
+
+void recordRenderWrite(RenderWorker *worker, uint32_t cycles, uint16_t adr,
+                       uint8_t val) {
+    struct RenderLog *log = &worker->recording;
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : LOG_MIN_CAPACITY;
+        log->writes =
+            realloc(log->writes, log->capacity * sizeof(*log->writes));
+        if (!log->writes)
+            PANIC;
+    }
+    log->writes[log->count++] =
+        (struct RenderWrite){.cycles = cycles, .adr = adr, .val = val};
+}
+
+//  Called with the lock held.
+static void waitForFrame(RenderWorker *worker) {
+    while (worker->busy)
+        pthread_cond_wait(&worker->done, &worker->lock);
+}
+
+void swapRenderFrame(RenderWorker *worker, uint32_t pixels[RES_Y][RES_X],
+                     bool wait) {
+    pthread_mutex_lock(&worker->lock);
+    waitForFrame(worker);
+    if (worker->drawn && !wait)
+        memcpy(pixels, worker->ppu.pixels, sizeof(worker->ppu.pixels));
+    struct RenderLog drawn = worker->replaying;
+    worker->replaying = worker->recording;
+    worker->recording = drawn;
+    worker->recording.count = 0;
+    worker->busy = true;
+    worker->drawn = true;
+    pthread_cond_signal(&worker->wake);
+    if (wait) {
+        waitForFrame(worker);
+        memcpy(pixels, worker->ppu.pixels, sizeof(worker->ppu.pixels));
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
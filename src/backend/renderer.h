@@ -0,0 +1,24 @@
+/*
+    Render worker. While one is attached the emulation thread keeps only the
+    PPU's timing, LY and STAT, and logs every write that can change the
+    picture with the frame cycle it landed on. At the end of a frame the log
+    is handed to a worker thread, which replays it against its own copy of
+    VRAM, OAM and the PPU registers while the next frame is emulated. Frames
+    thus come out one frame late.
+*/
+#pragma once
+#include <utility.h>
+#include "ppu.h"
+
+//  Copies the current state, called between frames.
+RenderWorker *createRenderWorker(const PPU *ppu, const uint8_t *vram,
+                                 const uint8_t *oam);
+//  Lets the frame in flight finish and stops the thread.
+void destroyRenderWorker(RenderWorker *worker);
+
+void recordRenderWrite(RenderWorker *worker, uint32_t cycles, uint16_t adr,
+                       uint8_t val);
+//  Hands the log of the frame that just ended to the worker and copies the
+//  frame before it to pixels, or the one just ended if wait is set.
+void swapRenderFrame(RenderWorker *worker, uint32_t pixels[RES_Y][RES_X],
+                     bool wait);
@@ -1,86 +1,57 @@
 #include"scheduler.h"
 #include<backend/cpu.h>
 
-EventFunc EVENT_FUNCS[eCOUNT] = {
-    [eDI] =
-        eventDI,
-    [eEI] =
-        eventEI,
+static const EventFunc EVENT_FUNCS[eCOUNT] = {
     [eTIMER_INTERRUPT] =
         eventTimerInterrupt,
-    [eEVALUATE_INTERRUPTS] =
-        eventEvaluateInterrupts
+    [ePPU_MODE] =
+        eventPPUMode
 };
 
+static void updateNextDeadline(Scheduler* sched){
+    uint64_t next = SCHED_NEVER;
+    for(size_t i = 0; i < eCOUNT; ++i){
+        if(sched->deadlines[i] < next)
+            next = sched->deadlines[i];
+    }
+    sched->next_deadline = next;
+}
+
 void initScheduler(Scheduler* sched, CPU* cpu){
     sched->reference = cpu;
-    sched->list_size = 0;
-    sched->list[0].cycles = 0;
+    for(size_t i = 0; i < eCOUNT; ++i)
+        sched->deadlines[i] = SCHED_NEVER;
+    sched->next_deadline = SCHED_NEVER;
 }
 
 void scheduleEvent(Scheduler* sched, size_t cycles, EventEnum event){
-    if(!EVENT_FUNCS[event] || sched->list_size + 1 > SCHED_MAX_ENTRIES)
+    if(!EVENT_FUNCS[event])
         PANIC;
-    uint64_t tot_cycles = sched->reference->t_cycles + cycles;
-    EventFunc func = EVENT_FUNCS[event];
-    bool is_duplicate = false;
-    for(size_t i = 0; i < sched->list_size; ++i){
-        if(sched->list[i].ee == event){
-            if(i != 0){
-                memmove(&sched->list[i], &sched->list[i+1], sizeof(*sched->list)*(SCHED_MAX_ENTRIES - i));
-            } else{
-                sched->list[0].cycles = UINT64_MAX;
-                size_t index = 0;
-                uint64_t value = UINT64_MAX;
-                for(size_t i = 1; i < sched->list_size; ++i){
-                    if(value > sched->list[i].cycles){
-                        value = sched->list[i].cycles;
-                        index = i;
-                    }
-                }
-                memmove(sched->list, &sched->list[index], sizeof(*sched->list));
-            }
-            is_duplicate = true;
-            break;
-        }
-    }
-    if(tot_cycles > sched->list[0].cycles){
-        sched->list[sched->list_size].cycles = tot_cycles;
-        sched->list[sched->list_size].func = func;
-        sched->list[sched->list_size].ee = event;
-    } else{
-        memmove(sched->list+1, sched->list, sizeof(sched->list)-sizeof(*sched->list));
-        sched->list[0].cycles = tot_cycles; 
-        sched->list[0].func = func;
-        sched->list[0].ee = event;
-    }
-    sched->list_size += !is_duplicate;
+    uint64_t deadline = sched->reference->t_cycles + cycles;
+    uint64_t prev = sched->deadlines[event];
+    sched->deadlines[event] = deadline;
+    if(deadline <= sched->next_deadline)
+        sched->next_deadline = deadline;
+    else if(prev == sched->next_deadline)
+        updateNextDeadline(sched);
 }
 
 void removeEvent(Scheduler* sched, EventEnum event){
-    
+    uint64_t prev = sched->deadlines[event];
+    sched->deadlines[event] = SCHED_NEVER;
+    if(prev != SCHED_NEVER && prev == sched->next_deadline)
+        updateNextDeadline(sched);
 }
 
-void tickScheduler(Scheduler* sched){
-    while(sched->list_size){
-        if(sched->list[0].cycles <= sched->reference->t_cycles){
-            EventFunc func = sched->list[0].func;
-            size_t index = 1;
-            uint64_t value = UINT64_MAX;
-            for(size_t i = 1; i < sched->list_size; ++i){
-                if(value > sched->list[i].cycles){
-                    value = sched->list[i].cycles;
-                    index = i;
-                }
-            }
-            struct SchedulerEntry tmp;
-            memcpy(&tmp, &sched->list[index], sizeof(tmp));
-            if(sched->list_size < SCHED_MAX_ENTRIES || index != sched->list_size-1)
-                memmove(&sched->list[index], &sched->list[index+1], sizeof(*sched->list)*(sched->list_size - index));
-            memcpy(sched->list, &tmp, sizeof(tmp));
-            --sched->list_size;
-            func(sched);
-        } else
-            break;
+void runDueEvents(Scheduler* sched){
+    PROFILE_ENTER(&sched->reference->profile, PROFILE_SCHEDULER);
+    while(sched->next_deadline <= sched->reference->t_cycles){
+        size_t event = 0;
+        while(sched->deadlines[event] != sched->next_deadline)
+            ++event;
+        sched->deadlines[event] = SCHED_NEVER;
+        updateNextDeadline(sched);
+        EVENT_FUNCS[event](sched);
     }
-}
\ No newline at end of file
+    PROFILE_LEAVE(&sched->reference->profile);
+}
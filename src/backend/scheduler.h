@@ -1,25 +1,30 @@
 #pragma once
 #include <utility.h>
 #include <backend/events.h>
-#define SCHED_MAX_ENTRIES 256
+//  Deadline of events that are not pending.
+#define SCHED_NEVER UINT64_MAX
 
 typedef struct CPU CPU;
 
-struct SchedulerEntry {
-    uint64_t cycles;
-    EventFunc func;
-    EventEnum ee;
-};
-
+//  One slot per EventEnum, an event is pending at most once.
 typedef struct Scheduler {
     CPU *reference;
-    size_t list_size;
-    struct SchedulerEntry list[SCHED_MAX_ENTRIES];
+    //  Earliest of deadlines, the only value checked per instruction.
+    uint64_t next_deadline;
+    //  t_cycles each event is due at, SCHED_NEVER if not pending.
+    uint64_t deadlines[eCOUNT];
 } Scheduler;
 
 void initScheduler(Scheduler *, CPU *cpu);
 
-void scheduleEvent(Scheduler *, size_t cycle, EventEnum event);
+//  Schedules event in cycles, moving it if it is already pending.
+void scheduleEvent(Scheduler *, size_t cycles, EventEnum event);
 void removeEvent(Scheduler *, EventEnum event);
 
-void tickScheduler(Scheduler *);
+//  Runs every event due by now, equal deadlines fire in EventEnum order.
+void runDueEvents(Scheduler *);
+
+static inline void tickScheduler(Scheduler *sched, uint64_t t_cycles) {
+    if (t_cycles >= sched->next_deadline)
+        runDueEvents(sched);
+}
@@ -0,0 +1,19 @@
+#include "tilecache.h"
+#include <string.h>
+#include "pixels.h"
+
+void decodeTile(TileCache *cache, const uint8_t *vram, uint16_t tile) {
+    decodeTileRows(&vram[tile * 16], &cache->pixels[tile][0][0], 8);
+    for (size_t row = 0; row < 8; ++row)
+        for (size_t x = 0; x < 8; ++x)
+            cache->flipped[tile][row][x] = cache->pixels[tile][row][7 - x];
+    cache->decoded[tile] = true;
+}
+
+void peekTileRow(const TileCache *cache, const uint8_t *vram, uint16_t tile,
+                 uint8_t row, uint8_t out[8]) {
+    if (cache->decoded[tile])
+        memcpy(out, cache->pixels[tile][row], 8);
+    else
+        decodeTileRows(&vram[tile * 16 + row * 2], out, 1);
+}
@@ -0,0 +1,39 @@
+/*
+    Tile data decoded to one colour index per pixel, together with every row
+    mirrored for flipped sprites. VRAM writes only mark their tile dirty, it
+    is decoded again the next time it is drawn, so renderers copy 8 ready
+    pixels per tile row instead of extracting bits.
+*/
+#pragma once
+#include <utility.h>
+
+//  0x8000-0x97FF, DMG has a single VRAM bank.
+#define TILE_COUNT 384
+#define TILE_DATA_SIZE (TILE_COUNT * 16)
+
+typedef struct {
+    uint8_t pixels[TILE_COUNT][8][8];
+    uint8_t flipped[TILE_COUNT][8][8];
+    //  Zeroed memory leaves every tile to be decoded on first use.
+    bool decoded[TILE_COUNT];
+} TileCache;
+
+void decodeTile(TileCache *cache, const uint8_t *vram, uint16_t tile);
+//  Decodes into out without updating the cache, for debug views running
+//  on another thread.
+void peekTileRow(const TileCache *cache, const uint8_t *vram, uint16_t tile,
+                 uint8_t row, uint8_t out[8]);
+
+//  offset is relative to the start of VRAM.
+static inline void markTileDirty(TileCache *cache, uint16_t offset) {
+    if (offset < TILE_DATA_SIZE)
+        cache->decoded[offset / 16] = false;
+}
+
+__always_inline const uint8_t *tileRow(TileCache *cache, const uint8_t *vram,
+                                       uint16_t tile, uint8_t row,
+                                       bool flip) {
+    if (!cache->decoded[tile])
+        decodeTile(cache, vram, tile);
+    return flip ? cache->flipped[tile][row] : cache->pixels[tile][row];
+}
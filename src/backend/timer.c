@@ -0,0 +1,89 @@
+#include "timer.h"
+#include <backend/cpu.h>
+
+#define TAC_ENABLE BIT(2)
+
+//  T-cycles per TIMA increment for each TAC clock select.
+static const uint16_t TAC_PERIODS[4] = {1024, 16, 64, 256};
+
+static uint64_t timerPeriod(const Timer *timer) {
+    return TAC_PERIODS[timer->tac & 0b11];
+}
+
+static void addTicks(CPU *cpu, uint64_t ticks) {
+    Timer *timer = &cpu->timer;
+    if (ticks < 0x100u - timer->tima) {
+        timer->tima += ticks;
+        return;
+    }
+    //  Every overflow reloads TMA, only the last one's remainder is left.
+    ticks -= 0x100u - timer->tima;
+    timer->tima = timer->tma + ticks % (0x100u - timer->tma);
+    requestInterrupt(cpu, INTERRUPT_TIMER);
+}
+
+void timerSync(CPU *cpu) {
+    Timer *timer = &cpu->timer;
+    if (timer->tac & TAC_ENABLE) {
+        uint64_t period = timerPeriod(timer);
+        uint64_t from = timer->synced_cycles - timer->div_base;
+        uint64_t to = cpu->t_cycles - timer->div_base;
+        addTicks(cpu, to / period - from / period);
+    }
+    timer->synced_cycles = cpu->t_cycles;
+}
+
+void scheduleTimerOverflow(CPU *cpu) {
+    Timer *timer = &cpu->timer;
+    if (!(timer->tac & TAC_ENABLE)) {
+        removeEvent(&cpu->sched, eTIMER_INTERRUPT);
+        return;
+    }
+    uint64_t period = timerPeriod(timer);
+    uint64_t counter = cpu->t_cycles - timer->div_base;
+    uint64_t overflow = (counter / period + 0x100 - timer->tima) * period;
+    scheduleEvent(&cpu->sched, overflow - counter, eTIMER_INTERRUPT);
+}
+
+uint8_t timerRead(CPU *cpu, enum TimerReg reg) {
+    Timer *timer = &cpu->timer;
+    switch (reg) {
+    case TIMER_DIV:
+        return (cpu->t_cycles - timer->div_base) >> 8;
+    case TIMER_TIMA:
+        timerSync(cpu);
+        return timer->tima;
+    case TIMER_TMA:
+        return timer->tma;
+    case TIMER_TAC:
+        return 0xF8 | timer->tac;
+    }
+    PANIC;
+    return 0;
+}
+
+void timerWrite(CPU *cpu, enum TimerReg reg, uint8_t val) {
+    Timer *timer = &cpu->timer;
+    timerSync(cpu);
+    switch (reg) {
+    case TIMER_DIV: {
+        //  Resetting the counter while the selected bit is set is an edge.
+        uint64_t period = timerPeriod(timer);
+        uint64_t counter = cpu->t_cycles - timer->div_base;
+        if ((timer->tac & TAC_ENABLE) && counter % period >= period / 2)
+            addTicks(cpu, 1);
+        timer->div_base = cpu->t_cycles;
+        break;
+    }
+    case TIMER_TIMA:
+        timer->tima = val;
+        break;
+    case TIMER_TMA:
+        timer->tma = val;
+        break;
+    case TIMER_TAC:
+        timer->tac = val & 0x07;
+        break;
+    }
+    scheduleTimerOverflow(cpu);
+}
@@ -0,0 +1,35 @@
+/*
+    DIV and TIMA derived from t_cycles instead of being stepped. DIV is the
+    top byte of a 16 bit counter running since its last reset, TIMA counts
+    the falling edges of the counter bit selected by TAC. Only the next
+    overflow is scheduled, so a running timer costs nothing in between.
+*/
+#pragma once
+#include <utility.h>
+
+typedef struct CPU CPU;
+
+enum TimerReg {
+    TIMER_DIV = 0xFF04,
+    TIMER_TIMA,
+    TIMER_TMA,
+    TIMER_TAC,
+};
+
+typedef struct {
+    //  t_cycles of the last divider reset.
+    uint64_t div_base;
+    //  t_cycles up to which tima is current.
+    uint64_t synced_cycles;
+    uint8_t tima, tma, tac;
+} Timer;
+
+uint8_t timerRead(CPU *cpu, enum TimerReg reg);
+void timerWrite(CPU *cpu, enum TimerReg reg, uint8_t val);
+
+//  Brings TIMA up to date, raising the interrupt for any overflow since the
+//  last sync.
+void timerSync(CPU *cpu);
+//  Schedules eTIMER_INTERRUPT for the next overflow, or drops it if the
+//  timer is stopped.
+void scheduleTimerOverflow(CPU *cpu);
@@ -0,0 +1,351 @@
+/*
+    Batch runner for large numbers of headless sessions. Each job of the
+    manifest loads a ROM, replays an optional input script, runs a number of
+    frames and hashes the final framebuffer. Jobs are spread over a
+    work-stealing thread pool where every worker reuses one CPU instance, and
+    results are streamed as one JSON object per line.
+
+    Manifest lines: <rom> <frames> [input script], '#' starts a comment.
+    Input script lines: <frame> <buttons>, buttons being '-' or a '+'
+    separated list of A, B, SELECT, START, RIGHT, LEFT, UP and DOWN. The
+    buttons stay pressed from that frame on until the next line.
+*/
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "backend/cpu.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+struct InputEvent {
+    uint64_t frame;
+    uint8_t buttons;
+};
+
+struct Job {
+    char *rom;
+    char *script;
+    uint64_t frames;
+};
+
+//  Deque of job indices, the owner pops from the back, thieves from the
+//  front.
+struct WorkQueue {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head, tail;
+};
+
+struct Batch {
+    const struct Job *jobs;
+    struct WorkQueue *queues;
+    size_t worker_count;
+    const char *boot_rom;
+    enum ExecMode mode;
+    bool idle_skip;
+    pthread_mutex_t output_lock;
+};
+
+struct Worker {
+    struct Batch *batch;
+    size_t id;
+};
+
+static const struct {
+    const char *name;
+    uint8_t button;
+} BUTTON_NAMES[] = {
+    {"A", JOYPAD_A},         {"B", JOYPAD_B},       {"SELECT", JOYPAD_SELECT},
+    {"START", JOYPAD_START}, {"RIGHT", JOYPAD_RIGHT}, {"LEFT", JOYPAD_LEFT},
+    {"UP", JOYPAD_UP},       {"DOWN", JOYPAD_DOWN},
+};
+
+static double hostSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool parseButtons(char *text, uint8_t *buttons) {
+    *buttons = 0;
+    if (!strcmp(text, "-"))
+        return true;
+    char *save;
+    for (char *name = strtok_r(text, "+", &save); name;
+         name = strtok_r(NULL, "+", &save)) {
+        size_t i = 0;
+        for (; i < sizeof(BUTTON_NAMES) / sizeof(*BUTTON_NAMES); ++i)
+            if (!strcasecmp(name, BUTTON_NAMES[i].name))
+                break;
+        if (i == sizeof(BUTTON_NAMES) / sizeof(*BUTTON_NAMES))
+            return false;
+        *buttons |= BUTTON_NAMES[i].button;
+    }
+    return true;
+}
+
+//  Returns the number of events or -1 if the script can't be read.
+static ssize_t loadInputScript(const char *path, struct InputEvent **events) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    size_t count = 0, capacity = 16;
+    *events = malloc(capacity * sizeof(**events));
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long long frame;
+        char buttons[200];
+        if (line[0] == '#' || sscanf(line, "%llu %199s", &frame, buttons) != 2)
+            continue;
+        if (count == capacity)
+            *events = realloc(*events, (capacity *= 2) * sizeof(**events));
+        (*events)[count].frame = frame;
+        if (!parseButtons(buttons, &(*events)[count].buttons)) {
+            fclose(file);
+            free(*events);
+            return -1;
+        }
+        ++count;
+    }
+    fclose(file);
+    return count;
+}
+
+static void printJSONString(FILE *file, const char *str) {
+    fputc('"', file);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            fprintf(file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(file, "\\u%04x", *str);
+        else
+            fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+static uint32_t hashFramebuffer(const PPU *ppu) {
+    const uint8_t *bytes = (const uint8_t *)ppu->pixels;
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < sizeof(ppu->pixels); ++i)
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    return hash;
+}
+
+static void runJob(struct Batch *batch, CPU *cpu, size_t worker, size_t index) {
+    const struct Job *job = &batch->jobs[index];
+    struct InputEvent *events = NULL;
+    ssize_t event_count = 0;
+    const char *error = NULL;
+    char fault[64];
+    if (access(job->rom, R_OK))
+        error = "rom could not be read";
+    else if (job->script &&
+             (event_count = loadInputScript(job->script, &events)) < 0)
+        error = "invalid input script";
+    double begin = hostSeconds();
+    uint32_t hash = 0;
+    if (!error) {
+        resetCPU(cpu);
+        setBootROM(&cpu->memory, batch->boot_rom);
+        if (!tryLoadROM(&cpu->memory, job->rom))
+            error = "rom could not be loaded";
+    }
+    if (!error) {
+        size_t next_event = 0;
+        for (uint64_t frame = 0; frame < job->frames; ++frame) {
+            while (next_event < (size_t)event_count &&
+                   events[next_event].frame <= frame)
+                setJoypad(cpu, events[next_event++].buttons);
+            runUntilFrame(cpu);
+            if (cpu->fault)
+                break;
+        }
+        hash = hashFramebuffer(&cpu->ppu);
+        if (cpu->fault) {
+            snprintf(fault, sizeof(fault), "%s at 0x%04x",
+                     cpu->fault == CPUFAULT_STOP ? "STOP" : "illegal opcode",
+                     cpu->fault_pc);
+            error = fault;
+        }
+    }
+    double seconds = hostSeconds() - begin;
+    free(events);
+    pthread_mutex_lock(&batch->output_lock);
+    printf("{\"job\": %zu, \"rom\": ", index);
+    printJSONString(stdout, job->rom);
+    if (error) {
+        printf(", \"error\": ");
+        printJSONString(stdout, error);
+    } else {
+        printf(", \"frames\": %llu, \"framebuffer_fnv1a\": \"%08x\", "
+               "\"cycles\": %llu, \"instructions\": %llu, \"seconds\": %.6f",
+               (unsigned long long)job->frames, hash,
+               (unsigned long long)cpu->t_cycles,
+               (unsigned long long)cpu->instructions, seconds);
+    }
+    printf(", \"worker\": %zu}\n", worker);
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->output_lock);
+}
+
+static bool popJob(struct WorkQueue *queue, size_t *job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head != queue->tail;
+    if (found)
+        *job = queue->jobs[--queue->tail];
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool stealJob(struct WorkQueue *queue, size_t *job) {
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->head != queue->tail;
+    if (found)
+        *job = queue->jobs[queue->head++];
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+//  Jobs are only ever removed, so a full pass of empty queues means done.
+static bool nextJob(struct Batch *batch, size_t worker, size_t *job) {
+    if (popJob(&batch->queues[worker], job))
+        return true;
+    for (size_t i = 1; i < batch->worker_count; ++i)
+        if (stealJob(&batch->queues[(worker + i) % batch->worker_count], job))
+            return true;
+    return false;
+}
+
+static void *runWorker(void *input) {
+    struct Worker *worker = input;
+    struct Batch *batch = worker->batch;
+    CPU *cpu = createCPU();
+    setExecMode(cpu, batch->mode);
+    setIdleSkip(cpu, batch->idle_skip);
+    size_t job;
+    while (nextJob(batch, worker->id, &job))
+        runJob(batch, cpu, worker->id, job);
+    destroyCPU(cpu);
+    return NULL;
+}
+
+//  Returns the number of jobs or -1 on a malformed manifest.
+static ssize_t loadManifest(FILE *file, struct Job **jobs) {
+    size_t count = 0, capacity = 64;
+    *jobs = malloc(capacity * sizeof(**jobs));
+    char line[3 * PATH_MAX];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        ++line_number;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        char *rom = strtok(line, " \t\r\n");
+        if (!rom)
+            continue;
+        char *frames = strtok(NULL, " \t\r\n");
+        char *script = strtok(NULL, " \t\r\n");
+        if (!frames || !isdigit((unsigned char)frames[0])) {
+            fprintf(stderr, "manifest line %zu: expected <rom> <frames>\n",
+                    line_number);
+            return -1;
+        }
+        if (count == capacity)
+            *jobs = realloc(*jobs, (capacity *= 2) * sizeof(**jobs));
+        (*jobs)[count].rom = strdup(rom);
+        (*jobs)[count].frames = strtoull(frames, NULL, 10);
+        (*jobs)[count].script = script ? strdup(script) : NULL;
+        ++count;
+    }
+    return count;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--cached|--dynarec] [--idle-skip] [--threads n] "
+            "[--boot path] <manifest|->\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    struct Batch batch = {
+        .boot_rom = "roms/dmg_boot.bin",
+        .mode = EXECMODE_INTERPRETER,
+    };
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *manifest = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cached"))
+            batch.mode = EXECMODE_CACHED;
+        else if (!strcmp(argv[i], "--dynarec"))
+            batch.mode = EXECMODE_DYNAREC;
+        else if (!strcmp(argv[i], "--idle-skip"))
+            batch.idle_skip = true;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--boot") && i + 1 < argc)
+            batch.boot_rom = argv[++i];
+        else
+            manifest = argv[i];
+    }
+    if (!manifest || threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    FILE *file = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+    if (!file) {
+        fprintf(stderr, "%s manifest could not be found!\n", manifest);
+        return 1;
+    }
+    struct Job *jobs;
+    ssize_t job_count = loadManifest(file, &jobs);
+    if (file != stdin)
+        fclose(file);
+    if (job_count < 0)
+        return 1;
+    if (access(batch.boot_rom, R_OK)) {
+        fprintf(stderr, "%s bootrom could not be found!\n", batch.boot_rom);
+        return 1;
+    }
+    batch.jobs = jobs;
+    batch.worker_count = threads;
+    batch.queues = calloc(threads, sizeof(*batch.queues));
+    pthread_mutex_init(&batch.output_lock, NULL);
+    //  Start with contiguous slices, stealing evens out uneven job lengths.
+    for (size_t w = 0; w < batch.worker_count; ++w) {
+        struct WorkQueue *queue = &batch.queues[w];
+        size_t begin = job_count * w / threads;
+        size_t end = job_count * (w + 1) / threads;
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->jobs = malloc((end - begin + 1) * sizeof(*queue->jobs));
+        for (size_t job = end; job > begin; --job)
+            queue->jobs[queue->tail++] = job - 1;
+    }
+    pthread_t *thread_ids = calloc(threads, sizeof(*thread_ids));
+    struct Worker *workers = calloc(threads, sizeof(*workers));
+    for (size_t w = 0; w < batch.worker_count; ++w) {
+        workers[w] = (struct Worker){.batch = &batch, .id = w};
+        pthread_create(&thread_ids[w], NULL, runWorker, &workers[w]);
+    }
+    for (size_t w = 0; w < batch.worker_count; ++w)
+        pthread_join(thread_ids[w], NULL);
+    for (size_t w = 0; w < batch.worker_count; ++w) {
+        pthread_mutex_destroy(&batch.queues[w].lock);
+        free(batch.queues[w].jobs);
+    }
+    for (ssize_t i = 0; i < job_count; ++i) {
+        free(jobs[i].rom);
+        free(jobs[i].script);
+    }
+    pthread_mutex_destroy(&batch.output_lock);
+    free(workers);
+    free(thread_ids);
+    free(batch.queues);
+    free(jobs);
+}
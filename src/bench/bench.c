@@ -0,0 +1,208 @@
+/*
+    Headless throughput benchmark. Runs every ROM for a fixed number of
+    emulated frames and reports host time, frames and instructions per
+    second, plus the per-subsystem time split when libcgb was built with
+    CGB_PROFILE.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "backend/cpu.h"
+#include "backend/pixels.h"
+
+#define DEFAULT_FRAMES 600
+#define GB_FPS (4194304.0 / FRAME_MAX_CYCLES)
+
+struct BenchResult {
+    const char *rom;
+    //  Mode actually used, the dynarec falls back on unsupported hosts.
+    enum ExecMode mode;
+    uint64_t frames;
+    uint64_t t_cycles;
+    uint64_t instructions;
+    uint64_t idle_skipped_cycles;
+    double seconds;
+    //  Fractions of the profiled time, all zero without CGB_PROFILE.
+    double share[PROFILE_ZONE_COUNT];
+    bool profiled;
+};
+
+static const char *ZONE_NAMES[PROFILE_ZONE_COUNT] = {
+    [PROFILE_CPU] = "cpu",
+    [PROFILE_PPU] = "ppu",
+    [PROFILE_MEMORY] = "memory",
+    [PROFILE_SCHEDULER] = "scheduler",
+};
+
+static const char *EXEC_MODE_NAMES[] = {
+    [EXECMODE_INTERPRETER] = "interpreter",
+    [EXECMODE_CACHED] = "cached",
+    [EXECMODE_DYNAREC] = "dynarec",
+};
+
+static const char *PIXEL_ISA_NAMES[] = {
+    [PIXEL_ISA_SCALAR] = "scalar",
+    [PIXEL_ISA_SSE2] = "sse2",
+    [PIXEL_ISA_AVX2] = "avx2",
+};
+
+static double hostSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void runBench(struct BenchResult *result, const char *boot_rom,
+                     enum ExecMode mode, bool idle_skip, bool render_thread,
+                     uint64_t frames) {
+    CPU *cpu = createCPU();
+    setExecMode(cpu, mode);
+    setIdleSkip(cpu, idle_skip);
+    setRenderThread(cpu, render_thread);
+    setBootROM(&cpu->memory, boot_rom);
+    loadROM(&cpu->memory, result->rom);
+    double begin = hostSeconds();
+    uint64_t frame = 0;
+    while (frame < frames && !cpu->fault) {
+        runUntilFrame(cpu);
+        ++frame;
+    }
+    result->seconds = hostSeconds() - begin;
+    if (cpu->fault)
+        fprintf(stderr, "%s stopped by a CPU fault at 0x%04x after %llu "
+                "frames\n", result->rom, cpu->fault_pc,
+                (unsigned long long)frame);
+    //  Attribute the time since the last zone switch.
+    switchProfileZone(&cpu->profile, PROFILE_CPU);
+    result->mode = cpu->exec_mode;
+    result->frames = frame;
+    result->t_cycles = cpu->t_cycles;
+    result->instructions = cpu->instructions;
+    result->idle_skipped_cycles = cpu->idle_skipped_cycles;
+    uint64_t total = 0;
+    for (size_t i = 0; i < PROFILE_ZONE_COUNT; ++i)
+        total += cpu->profile.ticks[i];
+    result->profiled = total != 0;
+    for (size_t i = 0; i < PROFILE_ZONE_COUNT; ++i)
+        result->share[i] = total ? (double)cpu->profile.ticks[i] / total : 0;
+    destroyCPU(cpu);
+}
+
+static void printText(const struct BenchResult *r, enum PixelISA isa,
+                      bool render_thread) {
+    printf("%s (%s, %s pixels%s)\n", r->rom, EXEC_MODE_NAMES[r->mode],
+           PIXEL_ISA_NAMES[isa], render_thread ? ", render thread" : "");
+    printf("  %llu frames in %.3fs, %.1f fps (%.1fx realtime)\n",
+           (unsigned long long)r->frames, r->seconds, r->frames / r->seconds,
+           r->frames / r->seconds / GB_FPS);
+    printf("  %llu instructions, %.2f MIPS\n",
+           (unsigned long long)r->instructions,
+           r->instructions / r->seconds / 1e6);
+    if (r->idle_skipped_cycles)
+        printf("  %.1f%% of cycles skipped in idle loops\n",
+               100.0 * r->idle_skipped_cycles / r->t_cycles);
+    if (r->profiled) {
+        printf("  time:");
+        for (size_t i = 0; i < PROFILE_ZONE_COUNT; ++i)
+            printf(" %s %.1f%%", ZONE_NAMES[i], 100.0 * r->share[i]);
+        printf("\n");
+    }
+}
+
+static void printJSON(const struct BenchResult *results, size_t count,
+                      bool idle_skip, enum PixelISA isa, bool render_thread) {
+    printf("{\"idle_skip\": %s, \"pixel_isa\": \"%s\", "
+           "\"render_thread\": %s, \"results\": [",
+           idle_skip ? "true" : "false", PIXEL_ISA_NAMES[isa],
+           render_thread ? "true" : "false");
+    for (size_t i = 0; i < count; ++i) {
+        const struct BenchResult *r = &results[i];
+        printf("%s\n  {\"rom\": \"", i ? "," : "");
+        for (const char *c = r->rom; *c; ++c)
+            printf(*c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+        printf("\", \"exec_mode\": \"%s\", \"frames\": %llu, "
+               "\"seconds\": %.6f, \"fps\": %.3f, \"instructions\": %llu, "
+               "\"mips\": %.3f, \"emulated_cycles\": %llu, "
+               "\"idle_skipped_cycles\": %llu, \"profile\": ",
+               EXEC_MODE_NAMES[r->mode], (unsigned long long)r->frames,
+               r->seconds, r->frames / r->seconds,
+               (unsigned long long)r->instructions,
+               r->instructions / r->seconds / 1e6,
+               (unsigned long long)r->t_cycles,
+               (unsigned long long)r->idle_skipped_cycles);
+        if (r->profiled) {
+            printf("{");
+            for (size_t z = 0; z < PROFILE_ZONE_COUNT; ++z)
+                printf("%s\"%s\": %.4f", z ? ", " : "", ZONE_NAMES[z],
+                       r->share[z]);
+            printf("}}");
+        } else {
+            printf("null}");
+        }
+    }
+    printf("\n]}\n");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [--cached|--dynarec] [--idle-skip] [--render-thread] "
+            "[--json] [--frames n] [--boot path] [--isa scalar|sse2|avx2] "
+            "<rom>...\n",
+            name);
+}
+
+int main(int argc, char *argv[]) {
+    enum ExecMode mode = EXECMODE_INTERPRETER;
+    bool idle_skip = false;
+    bool render_thread = false;
+    bool json = false;
+    uint64_t frames = DEFAULT_FRAMES;
+    const char *boot_rom = "roms/dmg_boot.bin";
+    //  Caps the pixel kernels, the best supported ones are used by default.
+    const char *isa = NULL;
+    const char **roms = calloc(argc, sizeof(*roms));
+    size_t rom_count = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cached"))
+            mode = EXECMODE_CACHED;
+        else if (!strcmp(argv[i], "--dynarec"))
+            mode = EXECMODE_DYNAREC;
+        else if (!strcmp(argv[i], "--idle-skip"))
+            idle_skip = true;
+        else if (!strcmp(argv[i], "--render-thread"))
+            render_thread = true;
+        else if (!strcmp(argv[i], "--json"))
+            json = true;
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            frames = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--boot") && i + 1 < argc)
+            boot_rom = argv[++i];
+        else if (!strcmp(argv[i], "--isa") && i + 1 < argc)
+            isa = argv[++i];
+        else
+            roms[rom_count++] = argv[i];
+    }
+    size_t max_isa = PIXEL_ISA_AVX2;
+    if (isa) {
+        for (max_isa = 0; max_isa <= PIXEL_ISA_AVX2; ++max_isa)
+            if (!strcmp(isa, PIXEL_ISA_NAMES[max_isa]))
+                break;
+    }
+    if (!rom_count || !frames || max_isa > PIXEL_ISA_AVX2) {
+        usage(argv[0]);
+        return 1;
+    }
+    enum PixelISA used_isa = selectPixelKernels(max_isa);
+    struct BenchResult *results = calloc(rom_count, sizeof(*results));
+    for (size_t i = 0; i < rom_count; ++i) {
+        results[i].rom = roms[i];
+        runBench(&results[i], boot_rom, mode, idle_skip, render_thread,
+                 frames);
+        if (!json)
+            printText(&results[i], used_isa, render_thread);
+    }
+    if (json)
+        printJSON(results, rom_count, idle_skip, used_isa, render_thread);
+    free(results);
+    free(roms);
+}
@@ -3,8 +3,12 @@
 #include <SDL2/SDL.h>
 
 typedef struct CPU CPU;
+typedef struct Display Display;
 
-void initDisplay(struct CPU *cpu, const char *name, size_t width,
-                 size_t height);
+//  Opens a window rendered by its own thread, one per emulator instance.
+Display *initDisplay(struct CPU *cpu, const char *name, size_t width,
+                     size_t height);
+void destroyDisplay(Display *display);
 
-void updateWindows(const void *pixeldata, size_t row_length);
+void updateWindows(Display *display, const void *pixeldata,
+                   size_t row_length);
@@ -1,18 +1,65 @@
 /*
     A GB(Gameboy/Game Boy) emulator written in C.
 */
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include "backend/cpu.h"
-#include <SDL2/SDL.h>
+#include <frontend/display.h>
+
+#define DEFAULT_SAVE_INTERVAL_MS 1000
+
+static volatile sig_atomic_t running = true;
+
+//  Leave the main loop so the battery save gets its final flush.
+static void stopRunning(int signal) { running = false; }
+
+static void presentFrame(const uint32_t *pixels, size_t row_length,
+                         void *user) {
+    updateWindows(user, pixels, row_length);
+    SDL_Delay(30);
+}
 
 int main(int argc, char *argv[]) {
     CPU *cpu = createCPU();
+    const char *rom_path = NULL;
+    uint32_t save_interval_ms = DEFAULT_SAVE_INTERVAL_MS;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--cached"))
+            setExecMode(cpu, EXECMODE_CACHED);
+        else if (!strcmp(argv[i], "--dynarec"))
+            setExecMode(cpu, EXECMODE_DYNAREC);
+        else if (!strcmp(argv[i], "--idle-skip"))
+            setIdleSkip(cpu, true);
+        else if (!strcmp(argv[i], "--render-thread"))
+            setRenderThread(cpu, true);
+        else if (!strcmp(argv[i], "--save-interval") && i + 1 < argc)
+            save_interval_ms = strtoul(argv[++i], NULL, 10);
+        else
+            rom_path = argv[i];
+    }
+    if (!rom_path) {
+        fprintf(stderr,
+                "usage: %s [--cached|--dynarec] [--idle-skip] "
+                "[--render-thread] [--save-interval ms] <rom>\n",
+                argv[0]);
+        return 1;
+    }
     setBootROM(&cpu->memory, "roms/dmg_boot.bin");
-    loadROM(&cpu->memory, argv[1]);
+    loadROM(&cpu->memory, rom_path);
+    enableBatterySave(&cpu->memory, save_interval_ms);
+    signal(SIGINT, stopRunning);
+    signal(SIGTERM, stopRunning);
     memWrite(&cpu->memory, 0xFF44, 0x90);
-    initDisplay(cpu, "gbemu", 160, 144);
-    while (true) {
-        updateCPU(cpu);
+    Display *display = initDisplay(cpu, "gbemu", 160, 144);
+    setFrameCallback(cpu, presentFrame, display);
+    while (running && !cpu->fault) {
+        runUntilFrame(cpu);
     }
+    if (cpu->fault)
+        fprintf(stderr, "cpu stopped by %s at 0x%04x\n",
+                cpu->fault == CPUFAULT_STOP ? "STOP" : "an illegal opcode",
+                cpu->fault_pc);
+    destroyDisplay(display);
     destroyCPU(cpu);
-}
\ No newline at end of file
+}
@@ -0,0 +1,384 @@
+/*
+    Regression checks for timing shortcuts that must not change what a ROM
+    observes. Each check assembles a small ROM, runs it through the core in
+    every execution mode and compares against the straightforward path.
+    Run by ctest, exits non-zero if any check fails.
+*/
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "backend/cpu.h"
+
+#define ROM_SIZE 0x8000
+#define CODE_BEG 0x150
+
+static char boot_path[] = "/tmp/cgb_regress_bootXXXXXX";
+static char rom_path[] = "/tmp/cgb_regress_romXXXXXX";
+
+static void writeFile(char *path, const uint8_t *data, size_t size) {
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+        fprintf(stderr, "%s could not be written!\n", path);
+        exit(1);
+    }
+    close(fd);
+}
+
+//  Writes a ROM that jumps from 0x100 to code at CODE_BEG, and a boot ROM
+//  that only sets SP and jumps to 0x100. Interrupts return right away.
+static void writeROM(const uint8_t *code, size_t size) {
+    static const uint8_t boot[256] = {0x31, 0xFE, 0xFF, 0xC3, 0x00, 0x01};
+    static uint8_t rom[ROM_SIZE];
+    memset(rom, 0, sizeof(rom));
+    for (uint16_t vector = 0x40; vector <= 0x60; vector += 8)
+        rom[vector] = 0xD9;
+    rom[0x100] = 0xC3;
+    rom[0x101] = CODE_BEG & 0xFF;
+    rom[0x102] = CODE_BEG >> 8;
+    memcpy(rom + CODE_BEG, code, size);
+    writeFile(boot_path, boot, sizeof(boot));
+    writeFile(rom_path, rom, sizeof(rom));
+}
+
+static CPU *startROM(enum ExecMode mode, bool idle_skip) {
+    CPU *cpu = createCPU();
+    setExecMode(cpu, mode);
+    setIdleSkip(cpu, idle_skip);
+    setBootROM(&cpu->memory, boot_path);
+    loadROM(&cpu->memory, rom_path);
+    return cpu;
+}
+
+static void removeROM(void) {
+    unlink(boot_path);
+    unlink(rom_path);
+    strcpy(boot_path + strlen(boot_path) - 6, "XXXXXX");
+    strcpy(rom_path + strlen(rom_path) - 6, "XXXXXX");
+}
+
+//  Counts mode 3 entries in (C000) by polling STAT, which the idle loop
+//  skipper must not jump over.
+static bool checkStatPollIdleSkip(void) {
+    static const uint8_t code[] = {
+        0xF3,                   //  DI
+        0xAF, 0xEA, 0x00, 0xC0, //  XOR A, LD (C000), A
+        0x3E, 0x91, 0xE0, 0x40, //  LD A, 0x91, LDH (LCDC), A
+        //  Wait for mode 3.
+        0xF0, 0x41, 0xE6, 0x03, 0xFE, 0x03, 0x20, 0xF8,
+        0x21, 0x00, 0xC0, 0x34, //  LD HL, C000, INC (HL)
+        //  Wait for mode 0.
+        0xF0, 0x41, 0xE6, 0x03, 0x20, 0xFA,
+        0x18, 0xEC, //  JR to the mode 3 wait
+    };
+    writeROM(code, sizeof(code));
+    bool ok = true;
+    for (enum ExecMode mode = EXECMODE_INTERPRETER; mode <= EXECMODE_DYNAREC;
+         ++mode) {
+        uint8_t counts[2];
+        for (int idle_skip = 0; idle_skip < 2; ++idle_skip) {
+            CPU *cpu = startROM(mode, idle_skip);
+            for (int frame = 0; frame < 10; ++frame)
+                runUntilFrame(cpu);
+            counts[idle_skip] = memRead(&cpu->memory, 0xC000);
+            destroyCPU(cpu);
+        }
+        if (counts[0] != counts[1]) {
+            fprintf(stderr, "mode %d: %02x mode 3 entries, %02x with idle "
+                    "skip\n", mode, counts[0], counts[1]);
+            ok = false;
+        }
+    }
+    removeROM();
+    return ok;
+}
+
+//  runCycles must not return much later than asked while the CPU is in a
+//  HALT that only a scheduled event could end.
+static bool checkHaltRunCycles(void) {
+    static const uint8_t code[] = {
+        0xF3,                   //  DI
+        0x3E, 0x91, 0xE0, 0x40, //  LD A, 0x91, LDH (LCDC), A
+        0xAF, 0xE0, 0xFF,       //  XOR A, LDH (IE), A
+        0x76, 0x18, 0xFD,       //  HALT, JR to it
+    };
+    writeROM(code, sizeof(code));
+    bool ok = true;
+    for (enum ExecMode mode = EXECMODE_INTERPRETER; mode <= EXECMODE_DYNAREC;
+         ++mode) {
+        CPU *cpu = startROM(mode, false);
+        for (int run = 0; run < 1000 && ok; ++run) {
+            uint64_t begin = cpu->t_cycles;
+            runCycles(cpu, 100);
+            //  Up to an M-cycle late, like any instruction.
+            if (cpu->t_cycles - begin > 100 + 3) {
+                fprintf(stderr, "mode %d: runCycles(100) ran %llu cycles\n",
+                        mode, (unsigned long long)(cpu->t_cycles - begin));
+                ok = false;
+            }
+        }
+        destroyCPU(cpu);
+    }
+    removeROM();
+    return ok;
+}
+
+//  Same for an idle loop polling P1 for a button that is never pressed.
+static bool checkIdleRunCycles(void) {
+    static const uint8_t code[] = {
+        0xF3,                   //  DI
+        0x3E, 0x91, 0xE0, 0x40, //  LD A, 0x91, LDH (LCDC), A
+        //  Wait for a button.
+        0xF0, 0x00, 0xE6, 0x0F, 0xFE, 0x0F, 0x28, 0xF8,
+        0x18, 0xFE, //  JR to itself
+    };
+    writeROM(code, sizeof(code));
+    bool ok = true;
+    for (enum ExecMode mode = EXECMODE_INTERPRETER; mode <= EXECMODE_DYNAREC;
+         ++mode) {
+        CPU *cpu = startROM(mode, true);
+        for (int run = 0; run < 1000 && ok; ++run) {
+            uint64_t begin = cpu->t_cycles;
+            runCycles(cpu, 100);
+            //  Up to one iteration of the loop late.
+            if (cpu->t_cycles - begin > 100 + 40) {
+                fprintf(stderr, "mode %d: runCycles(100) ran %llu cycles\n",
+                        mode, (unsigned long long)(cpu->t_cycles - begin));
+                ok = false;
+            }
+        }
+        destroyCPU(cpu);
+    }
+    removeROM();
+    return ok;
+}
+
+//  A short dump gets a padded copy in the shared image registry. Rewriting
+//  the file in place at the same size must not keep serving the old copy
+//  while an instance still holds it.
+static bool checkROMRewrite(void) {
+    static const uint8_t boot[256] = {0x31, 0xFE, 0xFF, 0xC3, 0x00, 0x01};
+    static uint8_t rom[ROM_SIZE / 2];
+    memset(rom, 0, sizeof(rom));
+    rom[CODE_BEG] = 0x11;
+    writeFile(boot_path, boot, sizeof(boot));
+    writeFile(rom_path, rom, sizeof(rom));
+    CPU *old = startROM(EXECMODE_INTERPRETER, false);
+    int fd = open(rom_path, O_WRONLY);
+    uint8_t val = 0x22;
+    //  Set apart explicitly, the rewrite can land in the same clock tick.
+    struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+    bool ok = fd >= 0 && pwrite(fd, &val, 1, CODE_BEG) == 1 &&
+              !futimens(fd, times);
+    if (fd >= 0)
+        close(fd);
+    CPU *cpu = startROM(EXECMODE_INTERPRETER, false);
+    uint8_t loaded = memRead(&cpu->memory, CODE_BEG);
+    if (!ok || loaded != val) {
+        fprintf(stderr, "rewritten rom reads %02x instead of %02x\n", loaded,
+                val);
+        ok = false;
+    }
+    destroyCPU(cpu);
+    destroyCPU(old);
+    removeROM();
+    return ok;
+}
+
+//  An illegal opcode must stop the run functions with the fault recorded,
+//  not take the process down.
+static bool checkCPUFault(void) {
+    static const uint8_t code[] = {
+        0x3E, 0x91, 0xE0, 0x40, //  LD A, 0x91, LDH (LCDC), A
+        0x00, 0xD3,             //  NOP, illegal
+    };
+    writeROM(code, sizeof(code));
+    bool ok = true;
+    for (enum ExecMode mode = EXECMODE_INTERPRETER; mode <= EXECMODE_DYNAREC;
+         ++mode) {
+        CPU *cpu = startROM(mode, false);
+        runUntilFrame(cpu);
+        runCycles(cpu, FRAME_MAX_CYCLES);
+        if (cpu->fault != CPUFAULT_ILLEGAL || cpu->fault_pc != CODE_BEG + 5) {
+            fprintf(stderr, "mode %d: fault %d at 0x%04x\n", mode, cpu->fault,
+                    cpu->fault_pc);
+            ok = false;
+        }
+        destroyCPU(cpu);
+    }
+    removeROM();
+    return ok;
+}
+
+static uint32_t nextRandom(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+//  Appends a random instruction that leaves SP and the code alone. Most go
+//  to register loads, ALU ops, INC/DEC and branches, the rest through
+//  memory, timer and LY reads or flag reading ops that stay with the
+//  handlers.
+static size_t emitRandomOp(uint8_t *code, uint32_t *state) {
+    static const uint8_t REGS[] = {0, 1, 2, 3, 4, 5, 7};
+    static const uint8_t HANDLER_OPS[] = {
+        0x27, 0x2F, 0x37, 0x3F, //  DAA, CPL, SCF, CCF
+        0x07, 0x0F, 0x17, 0x1F, //  RLCA, RRCA, RLA, RRA
+        0x09, 0x19, 0x29,       //  ADD HL, rr
+    };
+    uint32_t r = nextRandom(state);
+    uint8_t dst = REGS[(r >> 8) % 7], src = REGS[(r >> 16) % 7];
+    uint8_t imm = r >> 24;
+    switch (r % 14) {
+    case 0: //  LD r, r
+        code[0] = 0x40 | dst << 3 | src;
+        return 1;
+    case 1: //  LD r, u8
+        code[0] = 0x06 | dst << 3;
+        code[1] = imm;
+        return 2;
+    case 2: //  LD rr, u16 for BC, DE or HL
+        code[0] = 0x01 | (imm % 3) << 4;
+        code[1] = r >> 8;
+        code[2] = r >> 16;
+        return 3;
+    case 3:
+    case 4: //  ALU A, r
+        code[0] = 0x80 | (imm & 7) << 3 | src;
+        return 1;
+    case 5: //  ALU A, u8
+        code[0] = 0xC6 | (dst & 7) << 3;
+        code[1] = imm;
+        return 2;
+    case 6: //  INC r, DEC r
+        code[0] = 0x04 | dst << 3 | (imm & 1);
+        return 1;
+    case 7: //  INC rr, DEC rr for BC, DE or HL
+        code[0] = 0x03 | (imm % 3) << 4 | (imm & 8);
+        return 1;
+    case 8: //  JR cc over LD B, u8
+        code[0] = 0x20 | (imm & 3) << 3;
+        code[1] = 2;
+        code[2] = 0x06;
+        code[3] = imm;
+        return 4;
+    case 9: //  PUSH AF, POP r16 to see F
+        code[0] = 0xF5;
+        code[1] = 0xC1 | (imm % 3) << 4;
+        return 2;
+    case 10: //  LD (C0xx), A or LD A, (C0xx)
+        code[0] = imm & 1 ? 0xEA : 0xFA;
+        code[1] = r >> 8;
+        code[2] = 0xC0;
+        return 3;
+    case 11: //  SWAP r
+        code[0] = 0xCB;
+        code[1] = 0x30 | src;
+        return 2;
+    case 12: //  LDH A, (DIV), (TIMA) or (LY), which see any timing slip
+        code[0] = 0xF0;
+        code[1] = (const uint8_t[]){0x04, 0x05, 0x44}[imm % 3];
+        return 2;
+    default:
+        code[0] = HANDLER_OPS[imm % sizeof(HANDLER_OPS)];
+        return 1;
+    }
+}
+
+//  Random straight-line code run in a loop with the LCD, the timer and its
+//  interrupt on, so blocks keep running into deadlines. The dynarec
+//  translates most of it and must end up in the same state, cycle for
+//  cycle, as the interpreters.
+static bool checkDynarecMatches(void) {
+    bool ok = true;
+    for (uint32_t seed = 1; seed <= 16; ++seed) {
+        static uint8_t code[ROM_SIZE - CODE_BEG];
+        static const uint8_t setup[] = {
+            0xF3,                   //  DI
+            0x31, 0xF0, 0xDF,       //  LD SP, DFF0
+            0xAF, 0xEA, 0x00, 0xC1, //  XOR A, LD (C100), A
+            0x3E, 0x91, 0xE0, 0x40, //  LD A, 0x91, LDH (LCDC), A
+            0x3E, 0x05, 0xE0, 0x07, //  LD A, 0x05, LDH (TAC), A
+            0x3E, 0x04, 0xE0, 0xFF, //  LD A, 0x04, LDH (IE), A
+            0xFB,                   //  EI
+        };
+        memcpy(code, setup, sizeof(setup));
+        size_t size = sizeof(setup);
+        uint16_t loop = CODE_BEG + size;
+        uint32_t state = seed;
+        for (int i = 0; i < 200; ++i)
+            size += emitRandomOp(code + size, &state);
+        static const uint8_t tail[] = {
+            0xFA, 0x00, 0xC1, 0x3C, //  LD A, (C100), INC A
+            0xEA, 0x00, 0xC1,       //  LD (C100), A
+            0xC2, 0x00, 0x00,       //  JP NZ, loop
+            0x18, 0xFE,             //  JR to itself
+        };
+        memcpy(code + size, tail, sizeof(tail));
+        code[size + 8] = loop & 0xFF;
+        code[size + 9] = loop >> 8;
+        size += sizeof(tail);
+        writeROM(code, size);
+        CPU *cpus[EXECMODE_DYNAREC + 1];
+        for (enum ExecMode mode = EXECMODE_INTERPRETER;
+             mode <= EXECMODE_DYNAREC; ++mode) {
+            cpus[mode] = startROM(mode, false);
+            for (int frame = 0; frame < 8; ++frame)
+                runUntilFrame(cpus[mode]);
+        }
+        const CPU *ref = cpus[EXECMODE_INTERPRETER];
+        for (enum ExecMode mode = EXECMODE_CACHED; mode <= EXECMODE_DYNAREC;
+             ++mode) {
+            CPU *cpu = cpus[mode];
+            bool same = cpu->af == ref->af && cpu->bc == ref->bc &&
+                        cpu->de == ref->de && cpu->hl == ref->hl &&
+                        cpu->sp == ref->sp && cpu->pc == ref->pc &&
+                        cpu->t_cycles == ref->t_cycles &&
+                        cpu->instructions == ref->instructions;
+            for (uint16_t adr = 0xC000; adr <= 0xC1FF && same; ++adr)
+                same = memRead(&cpu->memory, adr) ==
+                       memRead(&cpus[EXECMODE_INTERPRETER]->memory, adr);
+            if (!same) {
+                fprintf(stderr, "seed %u, mode %d: af %04x pc %04x cycles "
+                        "%llu, interpreter af %04x pc %04x cycles %llu\n",
+                        seed, mode, cpu->af, cpu->pc,
+                        (unsigned long long)cpu->t_cycles, ref->af, ref->pc,
+                        (unsigned long long)ref->t_cycles);
+                ok = false;
+            }
+        }
+        for (enum ExecMode mode = EXECMODE_INTERPRETER;
+             mode <= EXECMODE_DYNAREC; ++mode)
+            destroyCPU(cpus[mode]);
+        removeROM();
+    }
+    return ok;
+}
+
+static const struct {
+    const char *name;
+    bool (*run)(void);
+} CHECKS[] = {
+    {"stat_poll_idle_skip", checkStatPollIdleSkip},
+    {"halt_run_cycles", checkHaltRunCycles},
+    {"idle_run_cycles", checkIdleRunCycles},
+    {"rom_rewrite", checkROMRewrite},
+    {"cpu_fault", checkCPUFault},
+    {"dynarec_matches", checkDynarecMatches},
+};
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(CHECKS) / sizeof(*CHECKS); ++i) {
+        if (argc > 1 && strcmp(argv[1], CHECKS[i].name))
+            continue;
+        bool ok = CHECKS[i].run();
+        printf("%s: %s\n", CHECKS[i].name, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    return failed != 0;
+}